@@ -0,0 +1,63 @@
+#!/bin/sh
+# Compare builds of the daemon: binary size, time from exec until the keyboards are attached, and peak RSS.
+# Needs root and the keyboard, stop the service first so only one daemon attaches.
+# Every run starts without pins so it loads and verifies the program, the keys are left without remaps afterwards.
+# --serial also runs every binary with --serial-startup, which loads the program before discovery instead of alongside it.
+# usage: sudo ./bench_startup.sh [runs=5] [--serial] binary...
+
+runs=5
+case "$1" in
+    ''|*[!0-9]*) ;;
+    *) runs=$1; shift ;;
+esac
+modes=parallel
+if [ "$1" = "--serial" ]; then
+    modes="parallel serial"
+    shift
+fi
+[ $# -gt 0 ] || set -- ./pxFnLock ./pxFnLock-static
+
+if systemctl is-active --quiet pxfnlock.service 2>/dev/null; then
+    echo "pxfnlock.service is running, stop it first" >&2
+    exit 1
+fi
+
+log=$(mktemp)
+trap 'rm -f "$log"' EXIT
+
+printf '%-24s %-8s %10s %12s %12s %10s\n' binary mode size_kb exec_to_ms startup_ms hwm_kb
+for bin in "$@"; do
+    [ -x "$bin" ] || { echo "skipping $bin, not built" >&2; continue; }
+    size=$(( $(stat -c %s "$bin") / 1024 ))
+    for mode in $modes; do
+        flags=--trace-startup
+        [ "$mode" = serial ] && flags="$flags --serial-startup"
+        i=0
+        while [ $i -lt "$runs" ]; do
+            # a pinned program would be adopted, which skips the load being measured
+            "$bin" unpin > /dev/null 2>&1
+            start=$(date +%s%N)
+            "$bin" $flags > "$log" 2>&1 &
+            pid=$!
+            # the trace line is printed once every keyboard is attached
+            until grep -q '^startup:' "$log"; do
+                kill -0 $pid 2>/dev/null || break
+                sleep 0.001
+            done
+            ready=$(date +%s%N)
+            hwm=$(awk '/^VmHWM:/ { print $2 }' /proc/$pid/status 2>/dev/null)
+            total=$(grep -o 'total_ms=[0-9.]*' "$log" | cut -d= -f2)
+            kill -TERM $pid 2>/dev/null
+            wait $pid 2>/dev/null
+            # the daemon leaves its pins for the next one on purpose
+            "$bin" unpin > /dev/null 2>&1
+            if [ -z "$total" ]; then
+                echo "$bin didn't start:" >&2
+                cat "$log" >&2
+                break
+            fi
+            printf '%-24s %-8s %10d %12.1f %12.1f %10s\n' "$bin" $mode $size "$(awk "BEGIN { print ($ready - $start) / 1e6 }")" $total "$hwm"
+            i=$((i + 1))
+        done
+    done
+done
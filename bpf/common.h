@@ -5,14 +5,140 @@
 #ifndef HIDTEST3_COMMON_H
 #define HIDTEST3_COMMON_H
 
+#ifndef __VMLINUX_H__
+#include <linux/types.h>
+#endif
+
 #define MAX_PATH 512
+#define REMAP_SLOTS 256 // scancodes are a single byte, so the table covers all of them
+#define MAX_STATIC_REMAPS 16 // max pairs that can be baked into .rodata
+#define FN_ESC_SCANCODE 0x4e // report 0x5a scancode sent by fn + esc, before remapping
+#define MAX_DEVICES 8 // keyboards the program can be attached to at once
+
+// the ProArt keyboard's fn lock feature report is 0x5a 0xd0 0x4e <state> padded with zeros
+#define FN_LOCK_REPORT_SIZE 63 // also the largest report a device profile can use
+#define FN_LOCK_REPORT_ID 0x5a
+#define FN_LOCK_REPORT_CMD 0xd0
+#define FN_LOCK_REPORT_SUB 0x4e
+#define FN_LOCK_REPORT_STATE_OFFSET 3
+#define HOTKEY_REPORT_ID 0x5a // the ProArt keyboard's vendor hotkey report
+#define HOTKEY_REPORT_SIZE 6 // report 0x5a, id then scancode
+
+enum event_type {
+    EVENT_KEY,     // a hotkey press
+    EVENT_FN_LOCK, // the bpf program changed the fn lock state itself
+    EVENT_HANDOVER, // a hot swapped program took a keyboard over, the old version's link can go
+};
 
 struct event_log_entry {
+    int type;
+    int hid_id;      // the keyboard the event came from
     int original;
     int remapped;
     int new;
+    int interesting; // the original scancode is in the interesting set
+    int fn_lock;     // EVENT_FN_LOCK only, the new state
 } ;
 
+// a model's fn lock feature report: report_id, cmd, sub, then the state at state_offset, zero padded to size
+struct fn_lock_report_layout {
+    __u8 report_id;
+    __u8 cmd;
+    __u8 sub;
+    __u8 state_offset;
+    __u8 size; // at most FN_LOCK_REPORT_SIZE
+};
+
+/*
+ * Commands queued by the daemon in the command ring buffer, applied in order by the apply_commands
+ * syscall program. Any number of them cost a single syscall.
+ */
+enum bpf_command_type {
+    CMD_SET_DEBUG_LEVEL,   // value: DEBUG_LEVEL_*
+    CMD_SET_KERNEL_TOGGLE, // value: 0 or 1
+    CMD_SET_FN_LOCK,       // hid_id, value: 0 = fn lock on, 1 = fn lock off, the report goes out after the drain
+    CMD_QUERY_FN_LOCK,     // hid_id, the state lands in command_request.fn_lock
+};
+
+#define COMMAND_RB_SIZE 4096
+
+struct bpf_command {
+    __u32 type; // enum bpf_command_type
+    int hid_id; // the keyboard for the fn lock commands, unused by the others
+    __u32 value;
+};
+
+// context of the apply_commands syscall program, everything is set by the program
+struct command_request {
+    int applied;      // commands drained or a negative error
+    int rejected;     // commands of an unknown type, also counted in STAT_BAD_COMMANDS
+    int fn_lock;      // state after the last fn lock command, -1 if its keyboard isn't attached
+    int report_error; // the last fn lock report that failed, 0 if every one went out
+};
+
+// context of the send_fn_lock syscall program
+struct fn_lock_request {
+    int hid_id;
+    __u32 fn_lock;
+    int retval; // set by the program, result of hid_bpf_hw_request
+};
+
+// fn lock state owned by the bpf program when it toggles in the kernel
+struct fn_lock_state {
+    __u32 fn_lock; // 0 = fn lock on, 1 = fn lock off, same as the state file
+    __u32 sent;    // value of fn_lock that the last successful report carried
+};
+
+/*
+ * Per keyboard state, keyed by hid id in the device map.
+ * fn_lock stays the first member, a hot swap hands it over even when the rest of the layout changed.
+ */
+struct device_state {
+    struct fn_lock_state fn_lock;
+};
+
+// one bit per scancode
+struct scancode_set {
+    __u64 bits[REMAP_SLOTS / 64];
+};
+
+// indexes into the per-cpu stats map
+enum stat_id {
+    STAT_REPORTS,        // every report seen by the program
+    STAT_HOTKEY_REPORTS, // report id 0x5a key presses
+    STAT_REMAPPED,       // presses that were remapped
+    STAT_UNMAPPED,       // presses with no remap entry
+    STAT_RINGBUF_DROPS,  // event records that didn't fit in the ring buffer
+    STAT_BAD_COMMANDS,   // commands the program didn't understand, see command_request
+    STAT_COUNT,
+};
+
+// per keyboard copy of the stats map counters, keyed by hid id
+struct device_stats {
+    __u64 counters[STAT_COUNT];
+};
+
+/*
+ * The single entry of the mmapable status map, pinned at BPF_STATUS_PIN so clients can poll it without syscalls.
+ * Only the daemon's main thread writes it, the bpf program never touches it. sequence is a seqcount: it is odd
+ * while the daemon writes and even once it is done, readers retry when it was odd or moved while they read.
+ */
+struct status_page {
+    __u64 sequence;             // bumped before and after every write
+    __u64 generation;           // bumped on every fn lock change, 0 until the state is first known
+    __u32 fn_lock;              // 0 = fn lock on, 1 = fn lock off
+    int hid_id;                 // the keyboard that changed last, -1 when the daemon set all of them
+    __u64 counters[STAT_COUNT]; // the stats map summed over every cpu, as of the daemon's last wakeup
+};
+
+#define DEBUG_LEVEL_NONE 0   // only update counters
+#define DEBUG_LEVEL_EVENTS 1 // also export every hotkey press to userspace
+
+struct bpf_settings {
+    __u32 debug_level;
+    __u32 kernel_toggle; // toggle fn lock from the bpf program on fn + esc
+};
+
 typedef struct {
     char input_device[MAX_PATH];
     char hidraw_device[MAX_PATH];
@@ -21,7 +147,15 @@ typedef struct {
 typedef struct {
     char hid_path[MAX_PATH];
     int hid_id;
+    int profile; // index of the matching device profile
 } hid_device_info_t;
 
+/*
+ * The remap table is an array indexed directly by the original scancode. Remapped scancodes hold
+ * REMAP_PRESENT | the new scancode, the rest 0, so a remap to 0x00 still works.
+ * Reloads build a whole new table and swap it in through remap_map, see bpf_update_remaps.
+ */
+#define REMAP_PRESENT 0x100
+
 
 #endif //HIDTEST3_COMMON_H
\ No newline at end of file
@@ -0,0 +1,13 @@
+#ifndef HIDTEST3_HID_BPF_HELPERS_H
+#define HIDTEST3_HID_BPF_HELPERS_H
+
+/*
+ * kfuncs that are missing from vmlinux.h, the declarations match the ones in
+ * the kernel's hid-bpf selftests
+ */
+extern int hid_bpf_hw_request(struct hid_bpf_ctx *ctx, __u8 *data, size_t buf__sz,
+                              enum hid_report_type type, enum hid_class_request reqtype) __weak __ksym;
+
+#define bpf_wq_set_callback(wq, cb, flags) bpf_wq_set_callback_impl(wq, cb, flags, NULL)
+
+#endif //HIDTEST3_HID_BPF_HELPERS_H
@@ -2,30 +2,405 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 #include "common.h"
+#include "hid_bpf_helpers.h"
 
+// the table the program starts with, userspace replaces it with tables of the same shape
+struct remap_table_map {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, u32);
+    __type(value, __u16);
+    __uint(max_entries, REMAP_SLOTS);
+} remap_table SEC(".maps");
+
+// holds the current table, swapping it is a single pointer update so a lookup never sees half a table
 struct {
-    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+    __type(key, u32);
+    __uint(max_entries, 1);
+    __array(values, struct remap_table_map);
+} remap_map SEC(".maps") = {
+    .values = { [0] = &remap_table },
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, u64);
+    __uint(max_entries, STAT_COUNT);
+} stats_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, u32);
+    __type(value, u64);
+    __uint(max_entries, REMAP_SLOTS);
+} unmapped_stats SEC(".maps");
+
+// written by the daemon and mmapped by clients, see struct status_page
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(map_flags, BPF_F_MMAPABLE);
+    __type(key, u32);
+    __type(value, struct status_page);
+    __uint(max_entries, 1);
+} status_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, u32);
+    __type(value, struct bpf_settings);
+    __uint(max_entries, 1);
+} settings_map SEC(".maps");
+
+// scancodes userspace acts on, only these wake the daemon immediately
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
     __type(key, u32);
-    __type(value, u32);
-    __uint(max_entries, 32);
-} remap_map SEC(".maps");
+    __type(value, struct scancode_set);
+    __uint(max_entries, 1);
+} interesting_map SEC(".maps");
+
+// diagnostic records are committed without a wakeup, every Nth one forces it
+#define DIAG_WAKEUP_BATCH 16
+__u32 diag_pending = 0;
+
+// created by the loader when it attaches to a keyboard, keyed by hid id
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, int);
+    __type(value, struct device_state);
+    __uint(max_entries, MAX_DEVICES);
+} device_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+    __type(key, int);
+    __type(value, struct device_stats);
+    __uint(max_entries, MAX_DEVICES);
+} device_stats SEC(".maps");
+
+/*
+ * hid id -> prog_version of the program that acts on the keyboard's reports. During a hot swap the
+ * new program is attached next to the old one, both see every report and only the owner changes it.
+ * A keyboard without an entry belongs to no version yet, this one leaves its reports alone.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, int);
+    __type(value, __u64);
+    __uint(max_entries, MAX_DEVICES);
+} owner_map SEC(".maps");
+
+/*
+ * hid ids a hot swap hands over to this version. Its link comes after the old version's, so once the old
+ * program acted on a report this one takes ownership for the next, and no report is changed twice or missed.
+ */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, int);
+    __type(value, __u32);
+    __uint(max_entries, MAX_DEVICES);
+} handover_map SEC(".maps");
+
+// deferred work for sending the fn lock report, keyed by hid id
+struct fn_lock_work {
+    struct bpf_wq work;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, int);
+    __type(value, struct fn_lock_work);
+    __uint(max_entries, MAX_DEVICES);
+} fn_lock_work_map SEC(".maps");
+
+// commands from the daemon, see enum bpf_command_type
+struct {
+    __uint(type, BPF_MAP_TYPE_USER_RINGBUF);
+    __uint(max_entries, COMMAND_RB_SIZE);
+} command_rb SEC(".maps");
+
+/*
+ * Static remaps are written into .rodata by the loader before the program is loaded.
+ * The verifier treats them as known constants, so unused pairs and the whole
+ * map lookup path below are dropped when this mode is used.
+ */
+const volatile __u32 static_remap_count = 0;
+const volatile __u8 static_remap_from[MAX_STATIC_REMAPS] = {};
+const volatile __u8 static_remap_to[MAX_STATIC_REMAPS] = {};
+
+// report ids and layout of the keyboard model, written by the loader from the device profile
+const volatile __u8 hotkey_report_id = HOTKEY_REPORT_ID;
+const volatile struct fn_lock_report_layout fn_lock_report = {
+    .report_id = FN_LOCK_REPORT_ID,
+    .cmd = FN_LOCK_REPORT_CMD,
+    .sub = FN_LOCK_REPORT_SUB,
+    .state_offset = FN_LOCK_REPORT_STATE_OFFSET,
+    .size = FN_LOCK_REPORT_SIZE,
+};
+
+// the version the loader pinned this object under, compared against owner_map
+const volatile __u64 prog_version = 0;
 
 struct{
     __uint(type, BPF_MAP_TYPE_RINGBUF);
     __uint(max_entries, 4096); // 4kb, needs to be mult of page size
 } event_rb SEC(".maps");
 
+/**
+ * Increment a per-cpu counter, no atomics are needed since each cpu has its own copy
+ * @param map: the per-cpu array to update
+ * @param id: index of the counter
+ */
+static __always_inline void stat_inc(void *map, u32 id)
+{
+    u64 *value = bpf_map_lookup_elem(map, &id);
+    if (value)
+        (*value)++;
+}
+
+/**
+ * Increment a stats map counter and the same counter of one keyboard
+ * @param stats: the keyboard's per-cpu counters, may be NULL
+ * @param id: index of the counter
+ */
+static __always_inline void device_stat_inc(struct device_stats *stats, u32 id)
+{
+    stat_inc(&stats_map, id);
+    if (stats && id < STAT_COUNT)
+        stats->counters[id]++;
+}
+
+/**
+ * Look up the replacement for a scancode
+ * @param code: the original scancode
+ * @param to: set to the new scancode if one exists
+ * @return 1 if the scancode is remapped, 0 otherwise
+ */
+static __always_inline int lookup_remap(__u8 code, __u8 *to)
+{
+    void *table;
+    __u16 *entry;
+    u32 key = 0, index = code;
+
+    if (static_remap_count)
+    {
+#pragma unroll
+        for (int i = 0; i < MAX_STATIC_REMAPS; i++)
+        {
+            if (i >= static_remap_count)
+                break;
+            if (code == static_remap_from[i])
+            {
+                *to = static_remap_to[i];
+                return 1;
+            }
+        }
+        return 0;
+    }
+
+    // both lookups are array lookups the verifier inlines, the scancode indexes the table directly
+    table = bpf_map_lookup_elem(&remap_map, &key);
+    if (!table)
+        return 0;
+    entry = bpf_map_lookup_elem(table, &index);
+    if (entry && (*entry & REMAP_PRESENT))
+    {
+        *to = *entry & 0xff;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Queue an event record for userspace
+ * Interesting scancodes always wake the reader. Diagnostic records are batched, since
+ * an adaptive wakeup would be skipped while earlier unread records are pending,
+ * interesting records force the wakeup instead.
+ * @param event: the record to copy into the ring buffer
+ */
+static __always_inline void export_event(const struct event_log_entry *event)
+{
+    struct event_log_entry *entry;
+    u64 flags;
+
+    entry = bpf_ringbuf_reserve(&event_rb, sizeof(*entry), 0);
+    if (!entry)
+    {
+        stat_inc(&stats_map, STAT_RINGBUF_DROPS);
+        return;
+    }
+    *entry = *event;
+
+    // the batch counter is shared between cpus, the atomic add hands exactly one of them every Nth record
+    if (event->interesting || (__sync_fetch_and_add(&diag_pending, 1) + 1) % DIAG_WAKEUP_BATCH == 0)
+    {
+        flags = BPF_RB_FORCE_WAKEUP;
+    }
+    else
+    {
+        flags = BPF_RB_NO_WAKEUP;
+    }
+    bpf_ringbuf_submit(entry, flags);
+}
+
+/**
+ * Send the fn lock feature report, must be called from a sleepable context
+ * @param hid_id: the keyboard to send the report to
+ * @param fn_lock: 0 = fn lock on, 1 = fn lock off
+ * @return the hid_bpf_hw_request result, negative on error
+ */
+static __always_inline int send_fn_lock_report(int hid_id, __u32 fn_lock)
+{
+    __u8 buf[FN_LOCK_REPORT_SIZE] = {};
+    __u32 size = fn_lock_report.size;
+    __u32 offset = fn_lock_report.state_offset;
+    struct hid_bpf_ctx *ctx;
+    int ret;
+
+    if (size == 0 || size > FN_LOCK_REPORT_SIZE || offset >= size)
+        return -22; // -EINVAL
+    buf[0] = fn_lock_report.report_id;
+    buf[1] = fn_lock_report.cmd;
+    buf[2] = fn_lock_report.sub;
+    buf[offset] = fn_lock;
+
+    ctx = hid_bpf_allocate_context(hid_id);
+    if (!ctx)
+        return -19; // -ENODEV
+    ret = hid_bpf_hw_request(ctx, buf, size, HID_FEATURE_REPORT, HID_REQ_SET_REPORT);
+    hid_bpf_release_context(ctx);
+    return ret;
+}
+
+/**
+ * Workqueue callback, sends the current fn lock state to the keyboard.
+ * Runs in a sleepable context so it can allocate a HID context and do the request.
+ * Several presses before the work runs collapse into one report with the latest state.
+ * If the report fails the state is rolled back to what the keyboard last got, so the daemon
+ * and the firmware agree.
+ * @param map: fn_lock_work_map
+ * @param key: the hid id of the keyboard
+ * @param value: the fn_lock_work element
+ * @return 0
+ */
+static int fn_lock_work_cb(void *map, int *key, void *value)
+{
+    struct device_state *state;
+    __u32 fn_lock;
+    int ret;
+
+    state = bpf_map_lookup_elem(&device_map, key);
+    if (!state)
+        return 0;
+    fn_lock = state->fn_lock.fn_lock;
+
+    ret = send_fn_lock_report(*key, fn_lock);
+    if (ret < 0)
+    {
+        bpf_printk("fn lock report failed: %d", ret);
+        // the keyboard kept the last state it got, go back to it unless a newer press already queued work again
+        if (state->fn_lock.fn_lock == fn_lock && state->fn_lock.sent != fn_lock)
+            state->fn_lock.fn_lock = state->fn_lock.sent;
+        return 0;
+    }
+    state->fn_lock.sent = fn_lock;
+
+    // userspace only needs to persist the new state
+    struct event_log_entry entry = {
+        .type = EVENT_FN_LOCK,
+        .hid_id = *key,
+        .fn_lock = fn_lock,
+    };
+    if (bpf_ringbuf_output(&event_rb, &entry, sizeof(entry), BPF_RB_FORCE_WAKEUP))
+        stat_inc(&stats_map, STAT_RINGBUF_DROPS);
+    return 0;
+}
+
+/**
+ * Flip the fn lock state and schedule the report to the keyboard
+ * @param hid_id: the keyboard the press came from
+ * @param state: that keyboard's entry in the device map
+ */
+static __always_inline void toggle_fn_lock(int hid_id, struct device_state *state)
+{
+    struct fn_lock_work init = {}, *elem;
+
+    // reports from one device are processed in order, so no atomics are needed
+    state->fn_lock.fn_lock = !state->fn_lock.fn_lock;
+
+    elem = bpf_map_lookup_elem(&fn_lock_work_map, &hid_id);
+    if (!elem)
+    {
+        if (bpf_map_update_elem(&fn_lock_work_map, &hid_id, &init, BPF_NOEXIST))
+            return;
+        elem = bpf_map_lookup_elem(&fn_lock_work_map, &hid_id);
+        if (!elem)
+            return;
+        if (bpf_wq_init(&elem->work, &fn_lock_work_map, 0) ||
+            bpf_wq_set_callback(&elem->work, fn_lock_work_cb, 0))
+            return;
+    }
+
+    // starting work that is already queued does nothing, which is the coalescing we want
+    bpf_wq_start(&elem->work, 0);
+}
+
+/**
+ * Take a hot swapped keyboard over from the old version, which already acted on the current report.
+ * From the next report on the old program sees it's no longer the owner and this one acts.
+ * @param hid_id: the keyboard, in handover_map
+ */
+static __always_inline void take_over(int hid_id)
+{
+    __u64 version = prog_version;
+
+    if (bpf_map_update_elem(&owner_map, &hid_id, &version, BPF_ANY))
+        return;
+    bpf_map_delete_elem(&handover_map, &hid_id);
+
+    // the daemon drops its reference to the old link
+    struct event_log_entry entry = {
+        .type = EVENT_HANDOVER,
+        .hid_id = hid_id,
+    };
+    if (bpf_ringbuf_output(&event_rb, &entry, sizeof(entry), BPF_RB_FORCE_WAKEUP))
+        stat_inc(&stats_map, STAT_RINGBUF_DROPS);
+}
+
 SEC("struct_ops/hid_bpf_device_event")
 int BPF_PROG(modify_hid_event, struct hid_bpf_ctx *hid_ctx)
 {
     __u8* data = hid_bpf_get_data(hid_ctx, 0, 6);
-    int *value;
+    __u8 code, new_code;
+    struct bpf_settings *settings;
+    struct scancode_set *interesting;
+    struct device_state *dev;
+    struct device_stats *dev_stats;
+    int hid_id = hid_ctx->hid->id;
+    __u64 *owner;
+    u32 key = 0;
+
+    // another version is still attached next to this one and handles the report
+    owner = bpf_map_lookup_elem(&owner_map, &hid_id);
+    if (!owner || *owner != prog_version)
+    {
+        if (bpf_map_lookup_elem(&handover_map, &hid_id))
+            take_over(hid_id);
+        return 0;
+    }
+
+    // one program serves every keyboard, state and counters are looked up by the device
+    dev = bpf_map_lookup_elem(&device_map, &hid_id);
+    dev_stats = bpf_map_lookup_elem(&device_stats, &hid_id);
+
+    device_stat_inc(dev_stats, STAT_REPORTS);
 
     if (!data)
         return 0;
 
-    // we're only interested in report id 90, which are the hotkey buttons
-    if (data[0] != 0x5a)
+    // we're only interested in the hotkey report, report id 90 on the ProArt keyboard
+    if (data[0] != hotkey_report_id)
         return 0; // Keep original data for other report ids
 
     if (data[1] == 0)
@@ -34,25 +409,182 @@ int BPF_PROG(modify_hid_event, struct hid_bpf_ctx *hid_ctx)
     // bpf_printk("Event: %x, %x, %x, %x, %x, %x", data[0],
     //   data[1], data[2], data[3], data[4], data[5]);
 
+    device_stat_inc(dev_stats, STAT_HOTKEY_REPORTS);
+
+    code = data[1];
     struct event_log_entry entry = {
-        .original = data[1],
+        .type = EVENT_KEY,
+        .hid_id = hid_id,
+        .original = code,
         .remapped = 0,
         .new = 0,
+        .interesting = 0,
     };
 
-    value = bpf_map_lookup_elem(&remap_map, &data[1]);
-    if (value)
+    if (lookup_remap(code, &new_code))
     {
-        entry.new = *value;
+        entry.new = new_code;
         entry.remapped = 1;
-        data[1] = *value; // remap the scancode if it exists in the map
+        data[1] = new_code; // remap the scancode if it exists in the table
+        device_stat_inc(dev_stats, STAT_REMAPPED);
     }
+    else
+    {
+        device_stat_inc(dev_stats, STAT_UNMAPPED);
+        stat_inc(&unmapped_stats, code);
+    }
+
+    settings = bpf_map_lookup_elem(&settings_map, &key);
+    if (settings && dev && settings->kernel_toggle && code == FN_ESC_SCANCODE)
+        toggle_fn_lock(hid_id, dev);
+
+    interesting = bpf_map_lookup_elem(&interesting_map, &key);
+    if (interesting && (interesting->bits[code / 64] & (1ULL << (code % 64))))
+        entry.interesting = 1;
+
+    // other events are only exported as diagnostics, by default userspace only reads the counters
+    if (!entry.interesting && (!settings || settings->debug_level < DEBUG_LEVEL_EVENTS))
+        return 0;
 
-    bpf_ringbuf_output(&event_rb, &entry, sizeof(struct event_log_entry), 0);
+    export_event(&entry);
 
     return 0;
 }
 
+/**
+ * Send the fn lock report on behalf of userspace, run with BPF_PROG_TEST_RUN.
+ * This replaces opening hidraw and doing a HIDIOCSFEATURE ioctl.
+ * @param args: the request, retval is filled in
+ * @return 0
+ */
+SEC("syscall")
+int send_fn_lock(struct fn_lock_request *args)
+{
+    args->retval = send_fn_lock_report(args->hid_id, args->fn_lock);
+    return 0;
+}
+
+// apply_commands' state while draining, kept on the stack for bpf_user_ringbuf_drain's callback
+struct command_batch {
+    int rejected;
+    int fn_lock;
+    int pending[MAX_DEVICES]; // keyboards whose fn lock changed, each gets one report after the drain
+    int pending_count;
+};
+
+/**
+ * Change a keyboard's fn lock state, the report is sent once the whole batch is applied
+ * @param batch: the drain's state
+ * @param hid_id: the keyboard
+ * @param fn_lock: 0 = fn lock on, 1 = fn lock off
+ */
+static __always_inline void set_fn_lock(struct command_batch *batch, int hid_id, __u32 fn_lock)
+{
+    struct device_state *state = bpf_map_lookup_elem(&device_map, &hid_id);
+
+    batch->fn_lock = -1;
+    if (!state)
+        return;
+    state->fn_lock.fn_lock = fn_lock != 0;
+    batch->fn_lock = state->fn_lock.fn_lock;
+
+    // several changes of one keyboard collapse into a report with the last state
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        if (i == batch->pending_count) {
+            batch->pending[i] = hid_id;
+            batch->pending_count++;
+            return;
+        }
+        if (batch->pending[i] == hid_id)
+            return;
+    }
+}
+
+/**
+ * Apply one command from the daemon, called by bpf_user_ringbuf_drain in the order they were queued
+ * @param dynptr: the command's sample
+ * @param ctx: the drain's struct command_batch
+ * @return 0 to keep draining, 1 to stop at a malformed command
+ */
+static long apply_command(struct bpf_dynptr *dynptr, void *ctx)
+{
+    struct command_batch *batch = ctx;
+    struct bpf_command cmd;
+    struct bpf_settings *settings;
+    struct device_state *state;
+    u32 key = 0;
+
+    if (bpf_dynptr_read(&cmd, sizeof(cmd), dynptr, 0, 0))
+    {
+        batch->rejected++;
+        stat_inc(&stats_map, STAT_BAD_COMMANDS);
+        return 1;
+    }
+
+    settings = bpf_map_lookup_elem(&settings_map, &key);
+    if (!settings)
+        return 1;
+    switch (cmd.type)
+    {
+    case CMD_SET_DEBUG_LEVEL:
+        settings->debug_level = cmd.value;
+        break;
+    case CMD_SET_KERNEL_TOGGLE:
+        settings->kernel_toggle = cmd.value;
+        break;
+    case CMD_SET_FN_LOCK:
+        set_fn_lock(batch, cmd.hid_id, cmd.value);
+        break;
+    case CMD_QUERY_FN_LOCK:
+        state = bpf_map_lookup_elem(&device_map, &cmd.hid_id);
+        batch->fn_lock = state ? state->fn_lock.fn_lock : -1;
+        break;
+    default:
+        // e.g. a newer daemon talking to an older pinned program
+        batch->rejected++;
+        stat_inc(&stats_map, STAT_BAD_COMMANDS);
+        break;
+    }
+    return 0;
+}
+
+/**
+ * Drain the command ring buffer, run with BPF_PROG_TEST_RUN after the daemon queued its commands.
+ * The program is sleepable, so the fn lock reports of the batch go out here rather than through the work queue.
+ * If a report fails the keyboard's state goes back to what it last got, like in fn_lock_work_cb.
+ * @param args: filled in, see struct command_request
+ * @return 0
+ */
+SEC("syscall")
+int apply_commands(struct command_request *args)
+{
+    struct command_batch batch = { .fn_lock = -1 };
+
+    args->applied = bpf_user_ringbuf_drain(&command_rb, apply_command, &batch, 0);
+    args->rejected = batch.rejected;
+    args->fn_lock = batch.fn_lock;
+    args->report_error = 0;
+
+    for (int i = 0; i < MAX_DEVICES && i < batch.pending_count; i++)
+    {
+        int hid_id = batch.pending[i];
+        struct device_state *state = bpf_map_lookup_elem(&device_map, &hid_id);
+        if (!state)
+            continue;
+        __u32 fn_lock = state->fn_lock.fn_lock;
+        int ret = send_fn_lock_report(hid_id, fn_lock);
+        if (ret < 0) {
+            args->report_error = ret;
+            state->fn_lock.fn_lock = state->fn_lock.sent;
+            continue;
+        }
+        state->fn_lock.sent = fn_lock;
+    }
+    return 0;
+}
+
+// created with the skeleton but never attached, it only ties modify_hid_event to hid_bpf_ops, see bpf_attach_device
 SEC(".struct_ops.link")
 struct hid_bpf_ops hid_modify_ops = {
     .hid_device_event = (void*)modify_hid_event,
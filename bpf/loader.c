@@ -3,57 +3,1541 @@
 //
 
 #include "loader.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <glob.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <bpf/bpf.h>
+#include <bpf/btf.h>
 #include <bpf/libbpf.h>
 #include "common.h"
+#include "../startup_trace.h"
 
-pthread_t ringbuf_polling_thread;
+#ifndef BPF_F_VTYPE_BTF_OBJ_FD
+#define BPF_F_VTYPE_BTF_OBJ_FD (1U << 15)
+#endif
+
+static struct hid_modify_bpf *skel = nullptr;
+static struct ring_buffer *rb = nullptr;
+static struct user_ring_buffer *commands = nullptr; // settings changes for the apply_commands program
+static struct status_page *status_page = nullptr;   // the status map, mapped writable, only the daemon writes it
+#define MAX_TRACED_PROGS 8
+// BPF_LOG_STATS output and trace field names of each program, only used with --trace-startup
+static struct {
+    char log[4096];
+    char insns[64];
+    char states[64];
+    char usec[64];
+} verifier_traces[MAX_TRACED_PROGS];
+static bpf_options_t event_options; // copy of the run_bpf options used by handle_event
+
+/*
+ * Where hid_bpf_ops lives inside the kernel's struct_ops map value,
+ * needed to build a struct_ops map for each device by hand
+ */
+static struct {
+    int found;
+    __u32 value_type_id; // bpf_struct_ops_hid_bpf_ops
+    __u32 value_size;
+    __u32 hid_id_offset; // offsets from the start of the map value
+    __u32 event_offset;
+    int btf_obj_fd;      // module BTF holding the type, -1 when it's in vmlinux
+} ops_layout = { .btf_obj_fd = -1 };
+
+/* a struct_ops map and link per attached keyboard, all sharing the loaded program */
+static struct {
+    int hid_id;
+    int map_fd;
+    int link_fd;
+    int stale_state; // device entry made up by a hot swap, bpf_attach_device fills in the fn lock state
+    int old_link_fd; // the old version's link during a hot swap, closed once the new program took over, else -1
+} attached[MAX_DEVICES];
+static int attached_count = 0;
+
+/*
+ * Everything run_bpf loads is pinned under BPF_PIN_DIR/<version>, so a restarted daemon adopts the
+ * running program and its links instead of verifying and attaching again. The keys keep working meanwhile.
+ */
+static char pin_dir[MAX_PATH];  // empty when bpffs isn't usable, nothing is pinned then
+static int pin_lock_fd = -1;    // flock on BPF_PIN_DIR, held until the process exits
+static int modify_prog_fd = -1; // the skeleton's programs, or opened from pin_dir
+static int send_prog_fd = -1;
+static int command_prog_fd = -1;
+static int adopted = 0;         // the program fds came from pin_dir and are ours to close
+static int remaps_static = 0;   // the remaps are in .rodata, bpf_update_remaps can't change them
+// the feature report worker sets the fn lock while the main thread changes settings
+static pthread_mutex_t command_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *stat_names[STAT_COUNT] = {
+    [STAT_REPORTS] = "reports",
+    [STAT_HOTKEY_REPORTS] = "hotkey reports",
+    [STAT_REMAPPED] = "remapped",
+    [STAT_UNMAPPED] = "unmapped",
+    [STAT_RINGBUF_DROPS] = "ringbuf drops",
+    [STAT_BAD_COMMANDS] = "bad commands",
+};
+
+/**
+ * Detach the old version from a keyboard the new program took over, see handover_map
+ * @param hid_id: the keyboard's HID device ID
+ */
+static void release_old_link(int hid_id)
+{
+    for (int i = 0; i < attached_count; i++)
+    {
+        if (attached[i].hid_id != hid_id || attached[i].old_link_fd < 0)
+            continue;
+        // the pin is already gone, this was the old link's last reference
+        close(attached[i].old_link_fd);
+        attached[i].old_link_fd = -1;
+        printf("hid %d handed over, the old program is detached\n", hid_id);
+    }
+}
 
 int handle_event(void *ctx, void *data, size_t data_sz)
 {
-    const struct event_log_entry *e = data;
-    if (e->remapped)
-        printf("Remapped: %x -> %x\n", e->original, e->new);
-    else
-        printf("Detected unmapped scancode: %x\n", e->original);
+    const struct event_log_entry *e = data;
+    const bpf_options_t *options = ctx;
+
+    if (e->type == EVENT_HANDOVER)
+    {
+        release_old_link(e->hid_id);
+        return 0;
+    }
+
+    if (e->type == EVENT_FN_LOCK)
+    {
+        printf("BPF toggled fn lock of hid %d to %s\n", e->hid_id, e->fn_lock ? "off" : "on");
+        bpf_publish_fn_lock(e->hid_id, e->fn_lock);
+        if (options->fn_lock_handler)
+            options->fn_lock_handler(e->fn_lock, options->fn_lock_handler_ctx);
+        return 0;
+    }
+
+    if (e->remapped)
+        printf("Remapped: %x -> %x\n", e->original, e->new);
+    else
+        printf("Detected unmapped scancode: %x\n", e->original);
+
+    if (e->interesting && options->key_handler)
+        options->key_handler(e->original, options->key_handler_ctx);
+
+    return 0;
+}
+
+/**
+ * Record a loaded program's verifier cost in the startup trace, as <program>_insns, _states and _verify_us
+ * @param prog: the loaded program
+ * @param trace: its slot in verifier_traces, the log was filled during load
+ */
+static void trace_verifier_stats(const struct bpf_program *prog, int trace)
+{
+    struct bpf_prog_info info = {};
+    __u32 info_len = sizeof(info);
+    const char *log = verifier_traces[trace].log;
+    const char *name = bpf_program__name(prog);
+    unsigned int value;
+    const char *line;
+
+    // the trace keeps the field names until it's emitted
+    snprintf(verifier_traces[trace].insns, sizeof(verifier_traces[trace].insns), "%s_insns", name);
+    snprintf(verifier_traces[trace].states, sizeof(verifier_traces[trace].states), "%s_states", name);
+    snprintf(verifier_traces[trace].usec, sizeof(verifier_traces[trace].usec), "%s_verify_us", name);
+
+    // verified_insns needs 5.16, the log has the same number on older kernels
+    if (bpf_prog_get_info_by_fd(bpf_program__fd(prog), &info, &info_len) == 0 && info.verified_insns)
+        trace_startup_value(verifier_traces[trace].insns, info.verified_insns);
+    else if ((line = strstr(log, "processed ")) && sscanf(line, "processed %u insns", &value) == 1)
+        trace_startup_value(verifier_traces[trace].insns, value);
+
+    if ((line = strstr(log, "total_states ")) && sscanf(line, "total_states %u", &value) == 1)
+        trace_startup_value(verifier_traces[trace].states, value);
+    if ((line = strstr(log, "verification time ")) && sscanf(line, "verification time %u usec", &value) == 1)
+        trace_startup_value(verifier_traces[trace].usec, value);
+}
+
+/**
+ * Check that both sides of a remap pair fit in a single byte scancode
+ * @return 1 if the pair is usable, 0 otherwise
+ */
+static int remap_in_range(int from_code, int to_code)
+{
+    if (from_code < 0 || from_code >= REMAP_SLOTS || to_code < 0 || to_code >= REMAP_SLOTS)
+    {
+        fprintf(stderr, "Ignoring out of range remap: %x -> %x\n", from_code, to_code);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Replace the remap table without reloading the program. The new table is filled with one batch update
+ * while the program still uses the old one, then published by swapping remap_map's single slot.
+ * A lookup sees either the whole old table or the whole new one.
+ * @param remap_array: pairs of original scancode, new scancode, later pairs win
+ * @param remap_count: number of pairs in remap_array
+ * @return 0 on success, -1 on error or if the remaps were baked in with --static-remaps
+ */
+int bpf_update_remaps(const int *remap_array, int remap_count)
+{
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 keys[REMAP_SLOTS];
+    __u16 values[REMAP_SLOTS] = {};
+    __u32 count = REMAP_SLOTS;
+    const __u32 key = 0;
+    int table_fd, err;
+
+    if (!skel || remaps_static) {
+        fprintf(stderr, "The remaps are part of the loaded program and can't be changed\n");
+        return -1;
+    }
+
+    for (int i = 0; i < remap_count; i ++)
+    {
+        const int from_code = remap_array[i * 2];
+        const int to_code = remap_array[i * 2 + 1];
+        if (!remap_in_range(from_code, to_code))
+            continue;
+        printf("Remapped: %x -> %x\n", from_code, to_code);
+        values[from_code] = REMAP_PRESENT | to_code;
+    }
+    for (__u32 i = 0; i < REMAP_SLOTS; i++)
+        keys[i] = i;
+
+    // same shape as remap_table in the program, anything else is rejected by the outer map
+    table_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "remap_table", sizeof(__u32), sizeof(__u16), REMAP_SLOTS, nullptr);
+    if (table_fd < 0) {
+        fprintf(stderr, "Failed to create remap table: %s\n", strerror(errno));
+        return -1;
+    }
+    err = bpf_map_update_batch(table_fd, keys, values, &count, &opts);
+    if (!err)
+        err = bpf_map_update_elem(bpf_map__fd(skel->maps.remap_map), &key, &table_fd, BPF_ANY);
+    // remap_map holds its own reference, the old table is freed once no program uses it
+    close(table_fd);
+    if (err) {
+        fprintf(stderr, "Failed to update remap table: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Queue a command for the running program, command_lock held
+ * @return 0 on success, -1 if the command ring buffer is full or run_bpf hasn't succeeded
+ */
+static int queue_command(enum bpf_command_type type, int hid_id, int value)
+{
+    struct bpf_command *cmd;
+
+    if (!commands)
+        return -1;
+    cmd = user_ring_buffer__reserve(commands, sizeof(*cmd));
+    if (!cmd) {
+        fprintf(stderr, "Failed to queue command %d: %s\n", type, strerror(errno));
+        return -1;
+    }
+    cmd->type = type;
+    cmd->hid_id = hid_id;
+    cmd->value = value;
+    user_ring_buffer__submit(commands, cmd);
+    return 0;
+}
+
+/**
+ * Apply every queued command in order with a single run of the apply_commands program, command_lock held
+ * @param request: filled in by the program
+ * @return 0 on success, -1 on error
+ */
+static int run_commands(struct command_request *request)
+{
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .ctx_in = request,
+        .ctx_size_in = sizeof(*request),
+        .ctx_out = request,
+        .ctx_size_out = sizeof(*request),
+    );
+    int err;
+
+    if (command_prog_fd < 0)
+        return -1;
+    err = bpf_prog_test_run_opts(command_prog_fd, &opts);
+    if (err || request->applied < 0) {
+        fprintf(stderr, "Failed to apply commands: %d %d\n", err, request->applied);
+        return -1;
+    }
+    if (request->rejected)
+        fprintf(stderr, "The program rejected %d unknown command(s)\n", request->rejected);
+    return 0;
+}
+
+/**
+ * Queue a settings change for the running program, nothing changes until bpf_apply_commands
+ * @param type: CMD_SET_DEBUG_LEVEL or CMD_SET_KERNEL_TOGGLE
+ * @param value: the setting's new value
+ * @return 0 on success, -1 if the command ring buffer is full or run_bpf hasn't succeeded
+ */
+int bpf_queue_command(enum bpf_command_type type, int value)
+{
+    pthread_mutex_lock(&command_lock);
+    int err = queue_command(type, -1, value);
+    pthread_mutex_unlock(&command_lock);
+    return err;
+}
+
+/**
+ * Apply every queued command in order with a single run of the apply_commands program
+ * @return 0 on success, -1 on error
+ */
+int bpf_apply_commands()
+{
+    struct command_request request = {};
+
+    pthread_mutex_lock(&command_lock);
+    int err = run_commands(&request);
+    pthread_mutex_unlock(&command_lock);
+    return err;
+}
+
+/**
+ * Set a keyboard's fn lock through the command ring buffer. Unlike bpf_send_fn_lock the program's own
+ * state follows, so --kernel-toggle flips from the state the keyboard really has.
+ * @param hid_id: an attached keyboard
+ * @param fn_lock: 0 = fn lock on, 1 = fn lock off
+ * @return 0 on success, -1 if the keyboard isn't attached, the report failed or no program is loaded here
+ */
+int bpf_set_fn_lock(int hid_id, int fn_lock)
+{
+    struct command_request request = {};
+
+    pthread_mutex_lock(&command_lock);
+    int err = queue_command(CMD_SET_FN_LOCK, hid_id, fn_lock) || run_commands(&request);
+    pthread_mutex_unlock(&command_lock);
+    if (err || request.fn_lock < 0)
+        return -1;
+    if (request.report_error) {
+        fprintf(stderr, "BPF feature report failed: %d\n", request.report_error);
+        errno = -request.report_error;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Read a keyboard's fn lock state as the program has it
+ * @param hid_id: an attached keyboard
+ * @return 0 = fn lock on, 1 = fn lock off, -1 if the keyboard isn't attached or no program is loaded here
+ */
+int bpf_query_fn_lock(int hid_id)
+{
+    struct command_request request = {};
+
+    pthread_mutex_lock(&command_lock);
+    int err = queue_command(CMD_QUERY_FN_LOCK, hid_id, 0) || run_commands(&request);
+    pthread_mutex_unlock(&command_lock);
+    return err ? -1 : request.fn_lock;
+}
+
+/**
+ * Set the program's settings, they go through the command ring buffer like later changes do
+ * @param options: the settings to apply
+ * @return 0 on success, -1 on error
+ */
+static int populate_settings(const bpf_options_t *options)
+{
+    if (bpf_queue_command(CMD_SET_DEBUG_LEVEL, options->debug_level) ||
+        bpf_queue_command(CMD_SET_KERNEL_TOGGLE, options->kernel_toggle) ||
+        bpf_apply_commands()) {
+        fprintf(stderr, "Failed to update settings map\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Set which original scancodes are reported to userspace immediately
+ * @param skel: Pointer to the loaded BPF skeleton
+ * @param codes: scancodes to report
+ * @param count: number of entries in codes
+ * @return 0 on success, -1 on error
+ */
+static int populate_interesting(struct hid_modify_bpf *skel, const int *codes, int count)
+{
+    struct scancode_set set = {};
+    const __u32 key = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        if (codes[i] < 0 || codes[i] >= REMAP_SLOTS)
+        {
+            fprintf(stderr, "Ignoring out of range scancode: %x\n", codes[i]);
+            continue;
+        }
+        set.bits[codes[i] / 64] |= 1ULL << (codes[i] % 64);
+    }
+
+    if (bpf_map_update_elem(bpf_map__fd(skel->maps.interesting_map), &key, &set, BPF_ANY)) {
+        fprintf(stderr, "Failed to update interesting scancode map\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open one of the running daemon's pinned maps or programs, used to reach them from another process.
+ * A single bpf_obj_get, and always the version the daemon is running even while another one is pinned.
+ * @param name: the map or program name, which is also its pin's name
+ * @return an fd on success, -1 if no daemon pinned it
+ */
+static int open_pinned(const char *name)
+{
+    char path[MAX_PATH];
+
+    snprintf(path, sizeof(path), "%s/%s", BPF_CURRENT_PIN, name);
+    return bpf_obj_get(path);
+}
+
+/**
+ * Send the fn lock feature report through the send_fn_lock syscall program.
+ * Uses this process's skeleton when loaded, otherwise the running daemon's program.
+ * @param hid_id: the keyboard to send the report to
+ * @param fn_lock: 0 = fn lock on, 1 = fn lock off
+ * @return 0 on success, -1 if the program isn't available or the request failed
+ */
+int bpf_send_fn_lock(int hid_id, int fn_lock)
+{
+    struct fn_lock_request request = {
+        .hid_id = hid_id,
+        .fn_lock = fn_lock,
+    };
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+        .ctx_in = &request,
+        .ctx_size_in = sizeof(request),
+        .ctx_out = &request,
+        .ctx_size_out = sizeof(request),
+    );
+    int prog_fd, err;
+
+    prog_fd = send_prog_fd >= 0 ? send_prog_fd : open_pinned("send_fn_lock");
+    if (prog_fd < 0)
+        return -1;
+
+    err = bpf_prog_test_run_opts(prog_fd, &opts);
+    if (prog_fd != send_prog_fd)
+        close(prog_fd);
+    if (err || request.retval < 0) {
+        fprintf(stderr, "BPF feature report failed: %d %d\n", err, request.retval);
+        errno = request.retval < 0 ? -request.retval : -err;
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Find the byte offset of a struct member in BTF
+ * @return the offset on success, -1 if the member doesn't exist
+ */
+static int btf_member_offset(const struct btf *btf, __u32 type_id, const char *name)
+{
+    const struct btf_type *t = btf__type_by_id(btf, type_id);
+    const struct btf_member *m = btf_members(t);
+
+    for (int i = 0; i < btf_vlen(t); i++, m++)
+    {
+        if (strcmp(btf__name_by_offset(btf, m->name_off), name) == 0)
+            return btf_member_bit_offset(t, i) / 8;
+    }
+    return -1;
+}
+
+/**
+ * Fill ops_layout from the BTF that defines hid_bpf_ops
+ * @param btf: vmlinux or module BTF
+ * @return 0 on success, -1 if the types aren't in this BTF
+ */
+static int read_ops_layout(const struct btf *btf)
+{
+    int value_id = btf__find_by_name_kind(btf, "bpf_struct_ops_hid_bpf_ops", BTF_KIND_STRUCT);
+    int ops_id = btf__find_by_name_kind(btf, "hid_bpf_ops", BTF_KIND_STRUCT);
+    int data_off, hid_id_off, event_off;
+
+    if (value_id < 0 || ops_id < 0)
+        return -1;
+
+    data_off = btf_member_offset(btf, value_id, "data");
+    hid_id_off = btf_member_offset(btf, ops_id, "hid_id");
+    event_off = btf_member_offset(btf, ops_id, "hid_device_event");
+    if (data_off < 0 || hid_id_off < 0 || event_off < 0)
+        return -1;
+
+    ops_layout.value_type_id = value_id;
+    ops_layout.value_size = btf__type_by_id(btf, value_id)->size;
+    ops_layout.hid_id_offset = data_off + hid_id_off;
+    ops_layout.event_offset = data_off + event_off;
+    ops_layout.found = 1;
+    return 0;
+}
+
+/**
+ * Look up the struct_ops value layout once, in vmlinux first and then in the hid module
+ * @return 0 on success, -1 if hid_bpf_ops isn't known to the kernel
+ */
+static int load_ops_layout()
+{
+    struct btf *vmlinux_btf;
+    __u32 id = 0;
+
+    if (ops_layout.found)
+        return 0;
+
+    vmlinux_btf = btf__load_vmlinux_btf();
+    if (!vmlinux_btf) {
+        fprintf(stderr, "Failed to load vmlinux BTF\n");
+        return -1;
+    }
+    if (read_ops_layout(vmlinux_btf) == 0) {
+        btf__free(vmlinux_btf);
+        return 0;
+    }
+
+    // CONFIG_HID=m, the type is in the module's split BTF
+    while (bpf_btf_get_next_id(id, &id) == 0)
+    {
+        struct bpf_btf_info info = {};
+        __u32 info_len = sizeof(info);
+        char name[64] = {};
+        int fd = bpf_btf_get_fd_by_id(id);
+        if (fd < 0)
+            continue;
+
+        info.name = (__u64)(unsigned long)name;
+        info.name_len = sizeof(name);
+        if (bpf_obj_get_info_by_fd(fd, &info, &info_len) == 0 && info.kernel_btf && strcmp(name, "hid") == 0)
+        {
+            struct btf *module_btf = btf__load_from_kernel_by_id_split(id, vmlinux_btf);
+            int err = module_btf ? read_ops_layout(module_btf) : -1;
+            btf__free(module_btf);
+            if (err == 0) {
+                ops_layout.btf_obj_fd = fd;
+                break;
+            }
+        }
+        close(fd);
+    }
+
+    btf__free(vmlinux_btf);
+    if (!ops_layout.found) {
+        fprintf(stderr, "Failed to find hid_bpf_ops in kernel BTF\n");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Create a keyboard's entries in the device state and stats maps
+ * @param hid_id: the keyboard's HID device ID
+ * @param fn_lock: the keyboard's current fn lock state
+ * @return 0 on success, -1 on error
+ */
+static int add_device_entries(int hid_id, int fn_lock)
+{
+    struct device_state state = {
+        .fn_lock = { .fn_lock = fn_lock, .sent = fn_lock },
+    };
+    int ncpus = libbpf_num_possible_cpus();
+    struct device_stats *stats;
+    int err;
+
+    if (ncpus <= 0)
+        return -1;
+    // per-cpu values are passed with one copy per possible cpu
+    stats = calloc(ncpus, sizeof(*stats));
+    if (!stats)
+        return -1;
+
+    err = bpf_map_update_elem(bpf_map__fd(skel->maps.device_map), &hid_id, &state, BPF_ANY);
+    if (!err)
+        err = bpf_map_update_elem(bpf_map__fd(skel->maps.device_stats), &hid_id, stats, BPF_ANY);
+    free(stats);
+    if (err) {
+        fprintf(stderr, "Failed to add hid %d to the device maps\n", hid_id);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Remove a keyboard's entries from the per device maps, freeing their slots
+ * @param hid_id: the keyboard's HID device ID
+ */
+static void remove_device_entries(int hid_id)
+{
+    bpf_map_delete_elem(bpf_map__fd(skel->maps.owner_map), &hid_id);
+    bpf_map_delete_elem(bpf_map__fd(skel->maps.handover_map), &hid_id);
+    bpf_map_delete_elem(bpf_map__fd(skel->maps.device_map), &hid_id);
+    bpf_map_delete_elem(bpf_map__fd(skel->maps.device_stats), &hid_id);
+    bpf_map_delete_elem(bpf_map__fd(skel->maps.fn_lock_work_map), &hid_id);
+}
+
+/**
+ * Make the loaded program the one that acts on a keyboard's reports, see owner_map
+ * @param hid_id: the keyboard's HID device ID
+ * @return 0 on success, -1 on error
+ */
+static int claim_device(int hid_id)
+{
+    const __u64 version = skel->rodata->prog_version;
+
+    if (bpf_map_update_elem(bpf_map__fd(skel->maps.owner_map), &hid_id, &version, BPF_ANY)) {
+        fprintf(stderr, "Failed to claim hid %d: %s\n", hid_id, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Build a struct_ops map that ties the loaded program to one keyboard, ready to be linked
+ * @param hid_id: the keyboard's HID device ID
+ * @return the map fd, -1 on error
+ */
+static int create_ops_map(int hid_id)
+{
+    LIBBPF_OPTS(bpf_map_create_opts, opts, .map_flags = BPF_F_LINK);
+    const __u32 key = 0;
+    unsigned char *value;
+    int map_fd;
+
+    if (load_ops_layout())
+        return -1;
+    opts.btf_vmlinux_value_type_id = ops_layout.value_type_id;
+    if (ops_layout.btf_obj_fd >= 0) {
+        opts.value_type_btf_obj_fd = ops_layout.btf_obj_fd;
+        opts.map_flags |= BPF_F_VTYPE_BTF_OBJ_FD;
+    }
+
+    value = calloc(1, ops_layout.value_size);
+    if (!value)
+        return -1;
+    // function pointer members take the program fd
+    *(int *)(value + ops_layout.hid_id_offset) = hid_id;
+    *(__u64 *)(value + ops_layout.event_offset) = modify_prog_fd;
+
+    map_fd = bpf_map_create(BPF_MAP_TYPE_STRUCT_OPS, "hid_modify_ops", sizeof(key), ops_layout.value_size, 1, &opts);
+    if (map_fd < 0 || bpf_map_update_elem(map_fd, &key, value, BPF_ANY)) {
+        fprintf(stderr, "Failed to create struct_ops map for hid %d: %s\n", hid_id, strerror(errno));
+        if (map_fd >= 0)
+            close(map_fd);
+        map_fd = -1;
+    }
+    free(value);
+    return map_fd;
+}
+
+/**
+ * Remember a keyboard's link and pin it, the link outlives the daemon and the next one adopts it
+ */
+static void add_attached(int hid_id, int map_fd, int link_fd)
+{
+    if (pin_dir[0])
+    {
+        char path[MAX_PATH];
+        snprintf(path, sizeof(path), "%s/link_%d", pin_dir, hid_id);
+        if (bpf_obj_pin(link_fd, path))
+            fprintf(stderr, "Failed to pin the link of hid %d: %s\n", hid_id, strerror(errno));
+    }
+
+    attached[attached_count].hid_id = hid_id;
+    attached[attached_count].map_fd = map_fd;
+    attached[attached_count].link_fd = link_fd;
+    attached[attached_count].stale_state = 0;
+    attached[attached_count].old_link_fd = -1;
+    attached_count++;
+}
+
+/**
+ * Attach the loaded program to a keyboard without loading it again.
+ * Every device gets its own struct_ops map pointing at the same verified program,
+ * the remap table and global counters are shared.
+ * @param hid_id: the HID device ID to attach to
+ * @param fn_lock: the keyboard's current fn lock state, the starting point for kernel_toggle
+ * @return 0 on success, -1 on error
+ */
+int bpf_attach_device(int hid_id, int fn_lock)
+{
+    int map_fd, link_fd;
+
+    if (!skel)
+        return -1;
+    // includes links adopted from the previous daemon or swapped over to this program
+    for (int i = 0; i < attached_count; i++)
+    {
+        if (attached[i].hid_id != hid_id)
+            continue;
+        if (attached[i].stale_state && add_device_entries(hid_id, fn_lock) == 0)
+            attached[i].stale_state = 0;
+        return 0;
+    }
+    if (attached_count >= MAX_DEVICES) {
+        fprintf(stderr, "Not attaching to hid %d, already attached to %d keyboards\n", hid_id, MAX_DEVICES);
+        return -1;
+    }
+
+    // the state has to exist before the first report reaches the program
+    if (add_device_entries(hid_id, fn_lock) || claim_device(hid_id)) {
+        remove_device_entries(hid_id);
+        return -1;
+    }
+
+    map_fd = create_ops_map(hid_id);
+    if (map_fd < 0) {
+        remove_device_entries(hid_id);
+        return -1;
+    }
+
+    link_fd = bpf_link_create(map_fd, 0, BPF_STRUCT_OPS, nullptr);
+    if (link_fd < 0) {
+        fprintf(stderr, "Failed to attach to hid %d: %s\n", hid_id, strerror(errno));
+        close(map_fd);
+        remove_device_entries(hid_id);
+        return -1;
+    }
+
+    add_attached(hid_id, map_fd, link_fd);
+    return 0;
+}
+
+/**
+ * Detach the program from a keyboard, e.g. after it was unplugged.
+ * The program and maps stay loaded for the next bpf_attach_device.
+ * @param hid_id: the HID device ID passed to bpf_attach_device
+ */
+void bpf_detach_device(int hid_id)
+{
+    for (int i = 0; i < attached_count; i++)
+    {
+        if (attached[i].hid_id != hid_id)
+            continue;
+
+        if (pin_dir[0])
+        {
+            char path[MAX_PATH];
+            snprintf(path, sizeof(path), "%s/link_%d", pin_dir, hid_id);
+            unlink(path);
+        }
+        close(attached[i].link_fd);
+        if (attached[i].old_link_fd >= 0)
+            close(attached[i].old_link_fd);
+        // adopted links don't come with their struct_ops map, the link holds it
+        if (attached[i].map_fd >= 0)
+            close(attached[i].map_fd);
+        remove_device_entries(hid_id);
+        attached[i] = attached[--attached_count];
+        return;
+    }
+}
+
+/**
+ * Sum every cpu's copy of a per-cpu counter
+ * @param map_fd: fd of a per-cpu array of u64
+ * @param id: index of the counter
+ * @param values: scratch buffer with room for one value per possible cpu
+ * @param ncpus: number of possible cpus
+ * @return the summed counter, 0 if the lookup failed
+ */
+static __u64 sum_percpu(int map_fd, __u32 id, __u64 *values, int ncpus)
+{
+    __u64 total = 0;
+
+    if (bpf_map_lookup_elem(map_fd, &id, values))
+        return 0;
+    for (int cpu = 0; cpu < ncpus; cpu++)
+        total += values[cpu];
+    return total;
+}
+
+/**
+ * Print the counters of every keyboard the running daemon is attached to
+ * @param ncpus: number of possible cpus
+ */
+static void print_device_stats(int ncpus)
+{
+    int map_fd = open_pinned("device_stats");
+    struct device_stats *values;
+    int hid_id, *prev = nullptr;
+
+    if (map_fd < 0)
+        return;
+    values = calloc(ncpus, sizeof(*values));
+    if (!values) {
+        close(map_fd);
+        return;
+    }
+
+    while (bpf_map_get_next_key(map_fd, prev, &hid_id) == 0)
+    {
+        prev = &hid_id;
+        if (bpf_map_lookup_elem(map_fd, &hid_id, values))
+            continue;
+        printf("hid %d\n", hid_id);
+        for (int i = 0; i < STAT_COUNT; i++)
+        {
+            __u64 total = 0;
+            for (int cpu = 0; cpu < ncpus; cpu++)
+                total += values[cpu].counters[i];
+            printf("  %-14s %llu\n", stat_names[i], (unsigned long long)total);
+        }
+    }
+
+    free(values);
+    close(map_fd);
+}
+
+/**
+ * Print the in-kernel event counters of the running daemon
+ * @return 0 on success, -1 on error
+ */
+int print_bpf_stats()
+{
+    int stats_fd, unmapped_fd;
+    int ncpus = libbpf_num_possible_cpus();
+    __u64 *values;
+
+    if (ncpus <= 0) {
+        fprintf(stderr, "Failed to get the number of cpus\n");
+        return -1;
+    }
+
+    stats_fd = open_pinned("stats_map");
+    unmapped_fd = open_pinned("unmapped_stats");
+    if (stats_fd < 0 || unmapped_fd < 0) {
+        fprintf(stderr, "Failed to find the stats maps, is the daemon running?\n");
+        return -1;
+    }
+
+    values = calloc(ncpus, sizeof(__u64));
+    if (!values) {
+        close(stats_fd);
+        close(unmapped_fd);
+        return -1;
+    }
+
+    for (__u32 i = 0; i < STAT_COUNT; i++)
+        printf("%-16s %llu\n", stat_names[i], (unsigned long long)sum_percpu(stats_fd, i, values, ncpus));
+
+    for (__u32 code = 0; code < REMAP_SLOTS; code++)
+    {
+        __u64 count = sum_percpu(unmapped_fd, code, values, ncpus);
+        if (count)
+            printf("unmapped %02x      %llu\n", code, (unsigned long long)count);
+    }
+
+    free(values);
+    close(stats_fd);
+    close(unmapped_fd);
+    print_device_stats(ncpus);
+    return 0;
+}
+
+/**
+ * Take the lock that keeps two daemons from attaching at once, creating BPF_PIN_DIR if needed
+ * @return 0 when locked, 1 if bpffs can't be used (nothing is pinned then), -1 if another daemon holds it
+ */
+static int lock_pins()
+{
+    if (pin_lock_fd >= 0)
+        return 0;
 
+    if (mkdir(BPF_PIN_DIR, 0700) && errno != EEXIST) {
+        perror("Failed to create " BPF_PIN_DIR);
+        return 1;
+    }
+    pin_lock_fd = open(BPF_PIN_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (pin_lock_fd < 0) {
+        perror("Failed to open " BPF_PIN_DIR);
+        return 1;
+    }
+    if (flock(pin_lock_fd, LOCK_EX | LOCK_NB)) {
+        int busy = errno == EWOULDBLOCK;
+        if (busy)
+            fprintf(stderr, "Another pxFnLock is already attached to the keyboard\n");
+        else
+            perror("Failed to lock " BPF_PIN_DIR);
+        close(pin_lock_fd);
+        pin_lock_fd = -1;
+        return busy ? -1 : 1;
+    }
     return 0;
 }
 
-void *poll_ringbuf( void *ptr )
+/**
+ * Hash the embedded object and its .rodata, a pinned program is only adopted if both match
+ * @return the version, changes with an upgrade, another device profile or --static-remaps
+ */
+static __u64 object_version()
 {
-    int err;
-    struct ring_buffer *rb = ptr;
-    printf("Starting ringbuff pollign thread\n");
-    while (1)
-    {
-        err = ring_buffer__poll(rb, 100 /* timeout, ms */);
-        /* Ctrl-C will cause -EINTR */
-        if (err == -EINTR) {
-            err = 0;
-            break;
+    size_t size;
+    const __u8 *elf = hid_modify_bpf__elf_bytes(&size);
+    const __u8 *rodata = (const __u8 *)skel->rodata;
+    __u64 hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ elf[i]) * 0x100000001b3ULL;
+    for (size_t i = 0; i < sizeof(*skel->rodata); i++)
+        hash = (hash ^ rodata[i]) * 0x100000001b3ULL;
+    return hash;
+}
+
+/**
+ * Unpin everything in a version directory and remove it, its links detach once nothing else holds them
+ */
+static void unpin_dir(const char *dir)
+{
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+
+    if (d == nullptr)
+        return;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (entry->d_name[0] != '.')
+            unlinkat(dirfd(d), entry->d_name, 0);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/**
+ * Unpin every version directory except one
+ * @param keep: the directory to leave alone, nullptr to unpin all of them
+ */
+static void unpin_versions(const char *keep)
+{
+    char path[MAX_PATH];
+    DIR *d = opendir(BPF_PIN_DIR);
+    struct dirent *entry;
+
+    if (d == nullptr)
+        return;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        // the status map's pin and the current link aren't versions
+        if (entry->d_type != DT_DIR) {
+            if (keep == nullptr)
+                unlinkat(dirfd(d), entry->d_name, 0);
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", BPF_PIN_DIR, entry->d_name);
+        if (keep == nullptr || strcmp(path, keep) != 0)
+        {
+            printf("Unpinning program %s\n", entry->d_name);
+            unpin_dir(path);
+        }
+    }
+    closedir(d);
+}
+
+/**
+ * Maps that get pinned, the internal .rodata/.bss maps are only reached through the programs
+ * and the skeleton's struct_ops map is never attached
+ */
+static int map_pinned(const struct bpf_map *map)
+{
+    return bpf_map__autocreate(map) && !bpf_map__is_internal(map) &&
+        bpf_map__type(map) != BPF_MAP_TYPE_STRUCT_OPS;
+}
+
+/**
+ * Pin the freshly loaded maps and programs into pin_dir, links are pinned by bpf_attach_device.
+ * Nothing stays pinned if any of it fails, the next daemon then loads the program again.
+ */
+static void pin_loaded()
+{
+    char path[MAX_PATH];
+    struct bpf_map *map;
+    int err = 0;
+
+    if (mkdir(pin_dir, 0700) && errno != EEXIST)
+        err = -1;
+    bpf_object__for_each_map(map, skel->obj)
+    {
+        if (err || !map_pinned(map))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(map));
+        err = bpf_obj_pin(bpf_map__fd(map), path);
+    }
+    // the programs go last, a directory without them is never adopted
+    snprintf(path, sizeof(path), "%s/send_fn_lock", pin_dir);
+    if (!err)
+        err = bpf_obj_pin(send_prog_fd, path);
+    snprintf(path, sizeof(path), "%s/apply_commands", pin_dir);
+    if (!err)
+        err = bpf_obj_pin(command_prog_fd, path);
+    snprintf(path, sizeof(path), "%s/modify_hid_event", pin_dir);
+    if (!err)
+        err = bpf_obj_pin(modify_prog_fd, path);
+
+    if (err) {
+        fprintf(stderr, "Failed to pin the program, a restart will load it again: %s\n", strerror(errno));
+        unpin_dir(pin_dir);
+        pin_dir[0] = '\0';
+    }
+}
+
+/**
+ * Check that a HID device still exists, its sysfs name ends with the device id in hex
+ */
+static int hid_device_present(int hid_id)
+{
+    char pattern[64];
+    glob_t matches;
+    int present;
+
+    snprintf(pattern, sizeof(pattern), "/sys/bus/hid/devices/*.%04X", hid_id);
+    present = glob(pattern, 0, nullptr, &matches) == 0;
+    globfree(&matches);
+    return present;
+}
+
+/**
+ * Take over the links the previous daemon pinned, dropping those of keyboards that went away meanwhile.
+ * The device map entries of adopted keyboards are kept, so their state and counters carry over.
+ */
+static void adopt_links()
+{
+    char path[MAX_PATH];
+    DIR *d = opendir(pin_dir);
+    struct dirent *entry;
+    int hid_id;
+
+    if (d == nullptr)
+        return;
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (sscanf(entry->d_name, "link_%d", &hid_id) != 1)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", pin_dir, entry->d_name);
+
+        int link_fd = -1;
+        if (attached_count < MAX_DEVICES && hid_device_present(hid_id))
+            link_fd = bpf_obj_get(path);
+        if (link_fd < 0)
+        {
+            unlink(path);
+            remove_device_entries(hid_id);
+            continue;
+        }
+        printf("Adopted the pinned link of hid %d\n", hid_id);
+        attached[attached_count].hid_id = hid_id;
+        attached[attached_count].map_fd = -1;
+        attached[attached_count].link_fd = link_fd;
+        attached[attached_count].old_link_fd = -1;
+        attached_count++;
+    }
+    closedir(d);
+}
+
+/**
+ * Use the maps and programs in pin_dir instead of loading the skeleton
+ * @return 0 if everything was adopted, -1 if pin_dir is incomplete and the skeleton has to be loaded
+ */
+static int adopt_pinned()
+{
+    char path[MAX_PATH];
+    struct bpf_map *map;
+    int map_fds[32], count = 0, err = 0;
+    int modify_fd, send_fd, command_fd;
+
+    snprintf(path, sizeof(path), "%s/modify_hid_event", pin_dir);
+    modify_fd = bpf_obj_get(path);
+    snprintf(path, sizeof(path), "%s/send_fn_lock", pin_dir);
+    send_fd = bpf_obj_get(path);
+    snprintf(path, sizeof(path), "%s/apply_commands", pin_dir);
+    command_fd = bpf_obj_get(path);
+    if (modify_fd < 0 || send_fd < 0 || command_fd < 0)
+        err = -1;
+
+    // every map has to be there before the skeleton is switched over to any of them
+    bpf_object__for_each_map(map, skel->obj)
+    {
+        if (err || !map_pinned(map))
+            continue;
+        if (count >= (int)(sizeof(map_fds) / sizeof(map_fds[0]))) {
+            err = -1;
+            continue;
         }
-        if (err < 0) {
-            printf("Error polling ring buffer: %d\n", err);
+        snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(map));
+        map_fds[count] = bpf_obj_get(path);
+        if (map_fds[count] < 0)
+            err = -1;
+        else
+            count++;
+    }
+
+    int i = 0;
+    bpf_object__for_each_map(map, skel->obj)
+    {
+        if (!err && map_pinned(map) && bpf_map__reuse_fd(map, map_fds[i++]))
+            err = -1;
+    }
+    // reuse_fd keeps its own copy
+    for (i = 0; i < count; i++)
+        close(map_fds[i]);
+
+    if (err) {
+        if (modify_fd >= 0)
+            close(modify_fd);
+        if (send_fd >= 0)
+            close(send_fd);
+        if (command_fd >= 0)
+            close(command_fd);
+        return -1;
+    }
+    modify_prog_fd = modify_fd;
+    send_prog_fd = send_fd;
+    command_prog_fd = command_fd;
+    adopted = 1;
+    adopt_links();
+    return 0;
+}
+
+/**
+ * Find the pins of another version of the program, e.g. the one running before an upgrade
+ * @param old_dir: filled with the version directory
+ * @return 0 if one was found, -1 otherwise
+ */
+static int find_old_version(char *old_dir, size_t size)
+{
+    char path[MAX_PATH];
+    DIR *d = opendir(BPF_PIN_DIR);
+    struct dirent *entry;
+    int err = -1;
+
+    if (d == nullptr)
+        return -1;
+    while (err && (entry = readdir(d)) != nullptr)
+    {
+        // the current link would find the running version a second time
+        snprintf(path, sizeof(path), "%s/%s/modify_hid_event", BPF_PIN_DIR, entry->d_name);
+        if (entry->d_name[0] == '.' || entry->d_type != DT_DIR || access(path, F_OK) != 0)
+            continue;
+        snprintf(old_dir, size, "%s/%s", BPF_PIN_DIR, entry->d_name);
+        err = strcmp(old_dir, pin_dir) == 0 ? -1 : 0;
+    }
+    closedir(d);
+    return err;
+}
+
+/**
+ * Before loading a new version, hand it the old version's state and counters when their layout didn't change.
+ * The remap and settings maps are filled again anyway, the ring buffer and work queue start empty.
+ * @param old_dir: the old version's pins
+ * @return 1 if owner_map is shared with the old version, 0 if the old program can't see a hand over
+ */
+static int carry_maps(const char *old_dir)
+{
+    int owner_shared = 0;
+    static const char *carried[] = {
+        "stats_map", "unmapped_stats", "device_map", "device_stats", "owner_map", "status_map",
+    };
+    char path[MAX_PATH];
+    struct bpf_map *map;
+
+    bpf_object__for_each_map(map, skel->obj)
+    {
+        for (size_t i = 0; i < sizeof(carried) / sizeof(carried[0]); i++)
+        {
+            struct bpf_map_info info = {};
+            __u32 info_len = sizeof(info);
+
+            if (strcmp(bpf_map__name(map), carried[i]) != 0)
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", old_dir, carried[i]);
+            int fd = bpf_obj_get(path);
+            if (fd < 0)
+                break;
+            if (bpf_map_get_info_by_fd(fd, &info, &info_len) == 0 &&
+                info.type == bpf_map__type(map) && info.key_size == bpf_map__key_size(map) &&
+                info.value_size == bpf_map__value_size(map) && info.max_entries == bpf_map__max_entries(map))
+            {
+                if (bpf_map__reuse_fd(map, fd) == 0 && strcmp(carried[i], "owner_map") == 0)
+                    owner_shared = 1;
+            }
+            else
+                printf("Not carrying %s over, its layout changed\n", carried[i]);
+            close(fd);
             break;
         }
     }
-    printf("Exiting polling thread\n");
-    return nullptr;
+    return owner_shared;
+}
+
+/**
+ * Hand a keyboard's fn lock state from the old version's device map to the new one, for when the
+ * device map couldn't be carried over.
+ * @param old_dir: the old version's pins
+ * @param hid_id: the keyboard's HID device ID
+ * @return 0 on success, -1 if the old version has no state for the keyboard
+ */
+static int copy_device_state(const char *old_dir, int hid_id)
+{
+    struct bpf_map_info info = {};
+    __u32 info_len = sizeof(info);
+    char path[MAX_PATH];
+    void *value = nullptr;
+    int fd, err = -1;
+
+    snprintf(path, sizeof(path), "%s/device_map", old_dir);
+    fd = bpf_obj_get(path);
+    if (fd < 0)
+        return -1;
+    // only struct fn_lock_state at the start of the value is known to match
+    if (bpf_map_get_info_by_fd(fd, &info, &info_len) == 0 && info.value_size >= sizeof(struct fn_lock_state))
+        value = calloc(1, info.value_size);
+    if (value && bpf_map_lookup_elem(fd, &hid_id, value) == 0)
+        err = add_device_entries(hid_id, ((const struct fn_lock_state *)value)->fn_lock);
+    free(value);
+    close(fd);
+    return err;
+}
+
+/**
+ * Move the old version's keyboards to the freshly loaded program, whose maps are already filled.
+ * hid_bpf_ops can't be updated in place, so each keyboard gets a second link to the new program behind the
+ * old one. The new program ignores the keyboard until it takes it over after a report the old one acted on,
+ * see handover_map, then handle_event drops the old link. The old pins go right away, this process holds
+ * the old links until then.
+ * An old version that doesn't share owner_map would keep acting next to the new one, its link is dropped
+ * before the new one is created instead and reports pass unchanged in between.
+ * @param old_dir: the old version's pins
+ * @param owner_shared: carry_maps handed owner_map over
+ */
+static void swap_links(const char *old_dir, int owner_shared)
+{
+    const __u32 handover = 1;
+    char path[MAX_PATH];
+    struct device_state state;
+    DIR *d = opendir(old_dir);
+    struct dirent *entry;
+    int hid_id;
+
+    if (d == nullptr)
+        return;
+    if (!owner_shared)
+        printf("The pinned program doesn't share owner_map, its keyboards are reattached\n");
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (sscanf(entry->d_name, "link_%d", &hid_id) != 1 ||
+            attached_count >= MAX_DEVICES || !hid_device_present(hid_id))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", old_dir, entry->d_name);
+
+        // a carried device map already has the entry
+        int stale_state = 0;
+        if (bpf_map_lookup_elem(bpf_map__fd(skel->maps.device_map), &hid_id, &state) &&
+            copy_device_state(old_dir, hid_id))
+        {
+            // bpf_attach_device sets the real state
+            if (add_device_entries(hid_id, 0))
+                continue;
+            stale_state = 1;
+        }
+
+        int map_fd = create_ops_map(hid_id);
+        if (map_fd < 0)
+            continue;
+        int link_fd = -1, old_link_fd = -1;
+        if (owner_shared)
+        {
+            old_link_fd = bpf_obj_get(path);
+            if (old_link_fd >= 0)
+                link_fd = bpf_link_create(map_fd, 0, BPF_STRUCT_OPS, nullptr);
+            if (link_fd >= 0 &&
+                bpf_map_update_elem(bpf_map__fd(skel->maps.handover_map), &hid_id, &handover, BPF_ANY))
+            {
+                close(link_fd);
+                link_fd = -1;
+            }
+        }
+        else
+        {
+            // the pin is the old link's last reference, the old program detaches from the keyboard here
+            unlink(path);
+            if (claim_device(hid_id) == 0)
+                link_fd = bpf_link_create(map_fd, 0, BPF_STRUCT_OPS, nullptr);
+        }
+        if (link_fd < 0)
+        {
+            // a shared old link stays until unpin_versions, bpf_attach_device links the keyboard again
+            fprintf(stderr, "Failed to swap hid %d: %s\n", hid_id, strerror(errno));
+            if (old_link_fd >= 0)
+                close(old_link_fd);
+            close(map_fd);
+            continue;
+        }
+        unlink(path);
+        printf("Swapped hid %d to the new program\n", hid_id);
+        add_attached(hid_id, map_fd, link_fd);
+        attached[attached_count - 1].stale_state = stale_state;
+        attached[attached_count - 1].old_link_fd = old_link_fd;
+    }
+    closedir(d);
+}
+
+/**
+ * Load the opened skeleton, which runs the verifier, and pin the result for the next daemon
+ * @return 0 on success, -1 on error with the skeleton destroyed
+ */
+static int load_skeleton()
+{
+    struct bpf_program *prog;
+    int err, trace = 0;
+
+    if (trace_startup_enabled())
+    {
+        // stats only, the verifier doesn't print the program, so the buffers stay small
+        bpf_object__for_each_program(prog, skel->obj)
+        {
+            if (trace >= MAX_TRACED_PROGS)
+                break;
+            bpf_program__set_log_buf(prog, verifier_traces[trace].log, sizeof(verifier_traces[trace].log));
+            bpf_program__set_log_level(prog, 4);
+            trace++;
+        }
+    }
+
+    err = hid_modify_bpf__load(skel);
+    if (err) {
+        fprintf(stderr, "Failed to load BPF skeleton\n");
+        hid_modify_bpf__destroy(skel);
+        skel = nullptr;
+        return -1;
+    }
+    trace_startup_phase("bpf_load");
+    if (trace_startup_enabled())
+    {
+        // same order as above, so each program finds its log by position
+        trace = 0;
+        bpf_object__for_each_program(prog, skel->obj)
+        {
+            if (trace >= MAX_TRACED_PROGS)
+                break;
+            if (bpf_program__autoload(prog))
+                trace_verifier_stats(prog, trace);
+            trace++;
+        }
+    }
+
+    modify_prog_fd = bpf_program__fd(skel->progs.modify_hid_event);
+    send_prog_fd = bpf_program__fd(skel->progs.send_fn_lock);
+    command_prog_fd = bpf_program__fd(skel->progs.apply_commands);
+    if (pin_dir[0])
+        pin_loaded();
+    return 0;
+}
+
+/**
+ * Pin the status map where clients find it whichever version is running. After an upgrade that couldn't
+ * carry the map over, clients that mapped the old one have to open it again.
+ */
+static void pin_status()
+{
+    unlink(BPF_STATUS_PIN);
+    if (bpf_obj_pin(bpf_map__fd(skel->maps.status_map), BPF_STATUS_PIN))
+        fprintf(stderr, "Failed to pin the status map: %s\n", strerror(errno));
+}
+
+/**
+ * Point BPF_CURRENT_PIN at pin_dir, other processes open the daemon's maps and programs through it
+ */
+static void link_current()
+{
+    const char *version = strrchr(pin_dir, '/') + 1;
+
+    unlink(BPF_CURRENT_PIN);
+    if (symlink(version, BPF_CURRENT_PIN))
+        fprintf(stderr, "Failed to link %s: %s\n", BPF_CURRENT_PIN, strerror(errno));
+}
+
+/**
+ * Start writing the status page, the sequence goes odd so readers retry until status_write_end.
+ * The daemon's main thread is the only writer, so the sequence needs no atomic increment.
+ */
+static void status_write_begin()
+{
+    __atomic_store_n(&status_page->sequence, status_page->sequence + 1, __ATOMIC_RELAXED);
+    // the odd sequence is visible before any of the new fields
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Finish writing the status page, the sequence goes even again
+ */
+static void status_write_end()
+{
+    __atomic_store_n(&status_page->sequence, status_page->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Publish a fn lock state on the status page
+ * @param hid_id: the keyboard the bpf program toggled, -1 when the daemon set every keyboard
+ * @param fn_lock: 0 = fn lock on, 1 = fn lock off
+ */
+void bpf_publish_fn_lock(int hid_id, int fn_lock)
+{
+    if (!status_page)
+        return;
+    status_write_begin();
+    __atomic_store_n(&status_page->fn_lock, fn_lock, __ATOMIC_RELAXED);
+    __atomic_store_n(&status_page->hid_id, hid_id, __ATOMIC_RELAXED);
+    __atomic_store_n(&status_page->generation, status_page->generation + 1, __ATOMIC_RELAXED);
+    status_write_end();
+}
+
+/**
+ * Refresh the counters on the status page from the per-cpu stats map, so the bpf program never writes
+ * memory shared by every cpu. The daemon calls this from handlers that run anyway, it never wakes up for it.
+ */
+void bpf_publish_counters()
+{
+    __u64 counters[STAT_COUNT], *values;
+    int ncpus = libbpf_num_possible_cpus();
+
+    if (!status_page || ncpus <= 0)
+        return;
+    values = calloc(ncpus, sizeof(*values));
+    if (!values)
+        return;
+    for (__u32 i = 0; i < STAT_COUNT; i++)
+        counters[i] = sum_percpu(bpf_map__fd(skel->maps.stats_map), i, values, ncpus);
+    free(values);
+
+    status_write_begin();
+    for (int i = 0; i < STAT_COUNT; i++)
+        __atomic_store_n(&status_page->counters[i], counters[i], __ATOMIC_RELAXED);
+    status_write_end();
+}
+
+/**
+ * Copy the status page, again while the daemon is writing it or wrote it during the copy
+ * @param page: the mapped status map
+ * @param copy: filled with a consistent snapshot
+ */
+static void read_status(const struct status_page *page, struct status_page *copy)
+{
+    __u64 sequence;
+
+    do {
+        sequence = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+            continue;
+        copy->generation = __atomic_load_n(&page->generation, __ATOMIC_RELAXED);
+        copy->fn_lock = __atomic_load_n(&page->fn_lock, __ATOMIC_RELAXED);
+        copy->hid_id = __atomic_load_n(&page->hid_id, __ATOMIC_RELAXED);
+        for (int i = 0; i < STAT_COUNT; i++)
+            copy->counters[i] = __atomic_load_n(&page->counters[i], __ATOMIC_RELAXED);
+        // the field loads complete before the sequence is checked again
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || __atomic_load_n(&page->sequence, __ATOMIC_RELAXED) != sequence);
+    copy->sequence = sequence;
+}
+
+/**
+ * Print one status snapshot
+ * @param counters: also print the counters, otherwise only the fn lock line
+ */
+static void print_status(const struct status_page *status, int counters)
+{
+    if (status->generation == 0)
+        printf("fn lock unknown\n");
+    else if (status->hid_id < 0)
+        printf("fn lock %s\n", status->fn_lock ? "off" : "on");
+    else
+        printf("fn lock %s (hid %d)\n", status->fn_lock ? "off" : "on", status->hid_id);
+    for (int i = 0; counters && i < STAT_COUNT; i++)
+        printf("%-16s %llu\n", stat_names[i], (unsigned long long)status->counters[i]);
+    fflush(stdout);
+}
+
+/**
+ * Print the running daemon's fn lock state and counters from the mmapped status map.
+ * Refreshing costs no syscall, only a load of the sequence counter.
+ * @param watch: keep polling and print the fn lock state again whenever it changes
+ * @return 0 on success, -1 if no daemon published the status map
+ */
+int print_bpf_status(int watch)
+{
+    LIBBPF_OPTS(bpf_obj_get_opts, opts, .file_flags = BPF_F_RDONLY);
+    const struct timespec poll_interval = { .tv_nsec = 100 * 1000 * 1000 };
+    const struct status_page *page;
+    struct status_page status;
+    int fd;
+
+    fd = bpf_obj_get_opts(BPF_STATUS_PIN, &opts);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open %s, is the daemon running?\n", BPF_STATUS_PIN);
+        return -1;
+    }
+    page = mmap(nullptr, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    // the mapping keeps the map alive
+    close(fd);
+    if (page == MAP_FAILED) {
+        perror("Failed to map the status map");
+        return -1;
+    }
+
+    read_status(page, &status);
+    print_status(&status, !watch);
+    while (watch)
+    {
+        __u64 generation = status.generation;
+
+        nanosleep(&poll_interval, nullptr);
+        if (__atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE) == status.sequence)
+            continue;
+        // the counters refresh whenever the daemon wakes, only a fn lock change is printed
+        read_status(page, &status);
+        if (status.generation != generation)
+            print_status(&status, 0);
+    }
+    munmap((void *)page, sizeof(*page));
+    return 0;
+}
+
+/**
+ * Unpin the daemon's program so it detaches from every keyboard, e.g. after stopping the service for good
+ * @return 0 on success, -1 if a daemon is still running
+ */
+int bpf_unpin_all()
+{
+    if (lock_pins() < 0)
+        return -1;
+    unpin_versions(nullptr);
+    return 0;
 }
 
-/** * This function loads the BPF program, attaches it to the HID device,
- * and sets up a map for remapping scancodes.
- * @param skel: Pointer to the BPF skeleton structure
- * @param hid_id: The HID device ID to attach the BPF program to
+/** * This function loads the BPF program and sets up a map for remapping scancodes.
+ * Keyboards are attached afterwards with bpf_attach_device, all of them share this object.
+ * The skeleton and ring buffer are kept until cleanup_bpf is called.
+ * @param options: remaps and settings to load
  * @return 0 on success, -1 on error
  */
-int run_bpf(struct hid_modify_bpf *skel, int hid_id, const int *remap_array, int remap_count)
+int run_bpf(const bpf_options_t *options)
 {
-    int err, map_fd;
-    struct ring_buffer *rb = nullptr;
+    int err;
+    const int *remap_array = options->remap_array;
+    int remap_count = options->remap_count;
+    int static_remaps = options->static_remaps;
 
     // Open and load the BPF program
     skel = hid_modify_bpf__open();
@@ -61,50 +1545,205 @@ int run_bpf(struct hid_modify_bpf *skel, int hid_id, const int *remap_array, int
         fprintf(stderr, "Failed to open BPF skeleton\n");
         return -1;
     }
+    trace_startup_phase("bpf_open");
 
-    skel->struct_ops.hid_modify_ops->hid_id = hid_id;
+    /*
+     * the skeleton's own struct_ops map is bound to one hid_id, devices are attached through
+     * maps made by bpf_attach_device instead so a replugged keyboard reuses the verified program.
+     * It's still created, libbpf resolves modify_hid_event's attach target while preparing it,
+     * but it's never attached.
+     */
 
-    err = hid_modify_bpf__load(skel);
-    if (err) {
-        fprintf(stderr, "Failed to load BPF skeleton\n");
-        return -1;
-   }
+    // the model's report layout is known before load, so it's baked into .rodata as well
+    if (options->hotkey_report_id)
+        skel->rodata->hotkey_report_id = options->hotkey_report_id;
+    if (options->fn_lock_report.size)
+        skel->rodata->fn_lock_report = options->fn_lock_report;
 
-    // Attach to HID device
-    err = hid_modify_bpf__attach(skel);
-    if (err) {
-        fprintf(stderr, "Failed to attach BPF program\n");
+    if (static_remaps && remap_count > MAX_STATIC_REMAPS)
+    {
+        printf("Too many remaps for static mode (%d > %d), using the remap map\n",
+            remap_count, MAX_STATIC_REMAPS);
+        static_remaps = 0;
+    }
+
+    remaps_static = static_remaps;
+    if (static_remaps)
+    {
+        // .rodata is frozen at load, so this has to happen before hid_modify_bpf__load
+        for (int i = 0; i < remap_count; i ++)
+        {
+            if (!remap_in_range(remap_array[i * 2], remap_array[i * 2 + 1]))
+                continue;
+            printf("Static remap: %x -> %x\n", remap_array[i * 2], remap_array[i * 2 + 1]);
+            skel->rodata->static_remap_from[skel->rodata->static_remap_count] = remap_array[i * 2];
+            skel->rodata->static_remap_to[skel->rodata->static_remap_count] = remap_array[i * 2 + 1];
+            skel->rodata->static_remap_count++;
+        }
+    }
+
+    // hashed while prog_version is still 0, the pins and owner_map use the same version
+    skel->rodata->prog_version = object_version();
+
+    err = lock_pins();
+    if (err < 0) {
         hid_modify_bpf__destroy(skel);
+        skel = nullptr;
         return -1;
     }
+    pin_dir[0] = '\0';
+    if (err == 0)
+        snprintf(pin_dir, sizeof(pin_dir), "%s/%016llx", BPF_PIN_DIR, (unsigned long long)skel->rodata->prog_version);
 
-    map_fd = bpf_map__fd(skel->maps.remap_map);
-    if (map_fd < 0) {
-        fprintf(stderr, "Failed to get map fd\n");
-        hid_modify_bpf__destroy(skel);
+    char old_dir[MAX_PATH];
+    int upgrade = 0, owner_shared = 0;
+    if (pin_dir[0] && adopt_pinned() == 0)
+    {
+        printf("Adopted the pinned program %s\n", pin_dir);
+        trace_startup_phase("bpf_adopt");
+    }
+    else if (pin_dir[0] && find_old_version(old_dir, sizeof(old_dir)) == 0)
+    {
+        // an upgrade, the old program keeps handling reports until its links are swapped over below
+        printf("Replacing the pinned program %s\n", old_dir);
+        unpin_dir(pin_dir);
+        owner_shared = carry_maps(old_dir);
+        if (load_skeleton())
+            return -1;
+        upgrade = 1;
+    }
+    else
+    {
+        if (pin_dir[0])
+            unpin_dir(pin_dir);
+        if (load_skeleton())
+            return -1;
+    }
+
+    // a failure only costs clients their updates from the daemon
+    status_page = mmap(nullptr, sizeof(*status_page), PROT_READ | PROT_WRITE, MAP_SHARED,
+        bpf_map__fd(skel->maps.status_map), 0);
+    if (status_page == MAP_FAILED) {
+        perror("Failed to map the status map");
+        status_page = nullptr;
+    }
+
+    commands = user_ring_buffer__new(bpf_map__fd(skel->maps.command_rb), nullptr);
+    if (!commands) {
+        fprintf(stderr, "Failed to create command ring buffer\n");
+        cleanup_bpf();
         return -1;
     }
 
-    for (int i = 0; i < remap_count; i ++)
+    // fill the maps before attaching so the first event already sees them
+    if (!static_remaps)
     {
-        const int *from_code = remap_array + i * 2;
-        const int *to_code = remap_array + i * 2 + 1;
-        printf("Remapped: %x -> %x\n", *from_code, *to_code);
-        bpf_map_update_elem(map_fd,
-            from_code,
-            to_code,
-            BPF_ANY);
+        err = bpf_update_remaps(remap_array, remap_count);
+        if (err) {
+            cleanup_bpf();
+            return -1;
+        }
+    }
+
+    err = populate_settings(options);
+    if (!err)
+        err = populate_interesting(skel, options->interesting_codes, options->interesting_count);
+    if (err) {
+        cleanup_bpf();
+        return -1;
+    }
+    trace_startup_phase("bpf_maps");
+
+    // every map is filled, the new program acts on the first report it's handed like the old one would
+    if (upgrade) {
+        swap_links(old_dir, owner_shared);
+        trace_startup_phase("bpf_swap");
+    }
+    // whatever is left of other versions is stale
+    if (pin_dir[0]) {
+        unpin_versions(pin_dir);
+        pin_status();
+        link_current();
     }
 
-    /* Set up ring buffer polling */
-    rb = ring_buffer__new(bpf_map__fd(skel->maps.event_rb), handle_event, NULL, nullptr);
+    /* Set up the ring buffer, the caller waits on bpf_events_fd */
+    event_options = *options;
+    rb = ring_buffer__new(bpf_map__fd(skel->maps.event_rb), handle_event, &event_options, nullptr);
     if (!rb) {
         fprintf(stderr, "Failed to create ring buffer\n");
+        cleanup_bpf();
         return -1;
     }
+    trace_startup_phase("bpf_ringbuf");
 
-    // need to poll to see output
-    pthread_create( &ringbuf_polling_thread, nullptr, poll_ringbuf, rb);
+    return 0;
+}
+
+/**
+ * Get an fd that becomes readable when the BPF program submits events
+ * @return the ring buffer's epoll fd, -1 if run_bpf hasn't succeeded
+ */
+int bpf_events_fd()
+{
+    if (!rb)
+        return -1;
+    return ring_buffer__epoll_fd(rb);
+}
 
+/**
+ * Handle every event currently in the ring buffer without blocking
+ * @return 0 on success, -1 on error
+ */
+int bpf_consume_events()
+{
+    int err = ring_buffer__consume(rb);
+    if (err < 0) {
+        printf("Error consuming ring buffer: %d\n", err);
+        return -1;
+    }
     return 0;
+}
+
+/**
+ * Free everything run_bpf created. Pinned links stay attached for the next daemon to adopt,
+ * see bpf_unpin_all to detach them.
+ */
+void cleanup_bpf()
+{
+    for (int i = 0; i < attached_count; i++)
+    {
+        // no report came to hand the keyboard over, the pinned new link takes it once the old one is gone.
+        // Claiming first could change a report in flight twice, a report in between passes unchanged instead.
+        if (attached[i].old_link_fd >= 0) {
+            close(attached[i].old_link_fd);
+            claim_device(attached[i].hid_id);
+            bpf_map_delete_elem(bpf_map__fd(skel->maps.handover_map), &attached[i].hid_id);
+        }
+        close(attached[i].link_fd);
+        if (attached[i].map_fd >= 0)
+            close(attached[i].map_fd);
+    }
+    attached_count = 0;
+    if (adopted) {
+        close(modify_prog_fd);
+        close(send_prog_fd);
+        close(command_prog_fd);
+    }
+    modify_prog_fd = -1;
+    send_prog_fd = -1;
+    command_prog_fd = -1;
+    adopted = 0;
+    if (ops_layout.btf_obj_fd >= 0)
+        close(ops_layout.btf_obj_fd);
+    ops_layout.btf_obj_fd = -1;
+    ops_layout.found = 0;
+    ring_buffer__free(rb);
+    rb = nullptr;
+    user_ring_buffer__free(commands);
+    commands = nullptr;
+    if (status_page)
+        munmap(status_page, sizeof(*status_page));
+    status_page = nullptr;
+    hid_modify_bpf__destroy(skel);
+    skel = nullptr;
 }
\ No newline at end of file
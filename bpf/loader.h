@@ -5,8 +5,63 @@
 #ifndef HIDTEST3_LOADER_H
 #define HIDTEST3_LOADER_H
 
+// the skeleton's .rodata uses types from common.h
+#include "common.h"
 #include "hid_modify.skel.h"
 
-int run_bpf(struct hid_modify_bpf *skel, int hid_id, const int *remap_array, int remap_count);
+// the daemon's maps, programs and links survive restarts here, see run_bpf
+#define BPF_PIN_DIR "/sys/fs/bpf/pxfnlock"
+// the status map, pinned outside the version directories so clients always find it
+#define BPF_STATUS_PIN BPF_PIN_DIR "/status"
+// symlink to the running daemon's version directory
+#define BPF_CURRENT_PIN BPF_PIN_DIR "/current"
+
+/**
+ * Called from bpf_consume_events for every event with an interesting scancode
+ * @param scancode: the original scancode, before remapping
+ * @param ctx: key_handler_ctx from bpf_options_t
+ */
+typedef void (*key_handler_t)(int scancode, void *ctx);
+
+/**
+ * Called from bpf_consume_events when the bpf program changed the fn lock state
+ * @param fn_lock: the new state, 0 = fn lock on, 1 = fn lock off
+ * @param ctx: fn_lock_handler_ctx from bpf_options_t
+ */
+typedef void (*fn_lock_handler_t)(int fn_lock, void *ctx);
+
+typedef struct {
+    int hotkey_report_id;   // the model's hotkey report, 0 keeps HOTKEY_REPORT_ID
+    struct fn_lock_report_layout fn_lock_report; // the model's fn lock report, size 0 keeps the ProArt layout
+    const int *remap_array; // pairs of original scancode, new scancode
+    int remap_count;        // number of pairs in remap_array
+    int static_remaps;      // bake the remaps into .rodata instead of the remap map
+    int debug_level;        // DEBUG_LEVEL_* from common.h
+    const int *interesting_codes; // original scancodes that should wake the daemon
+    int interesting_count;  // number of entries in interesting_codes
+    key_handler_t key_handler; // optional, called for interesting scancodes
+    void *key_handler_ctx;
+    int kernel_toggle;      // the bpf program toggles fn lock itself on fn + esc
+    fn_lock_handler_t fn_lock_handler; // optional, called after the bpf program toggled
+    void *fn_lock_handler_ctx;
+} bpf_options_t;
+
+int run_bpf(const bpf_options_t *options);
+int bpf_update_remaps(const int *remap_array, int remap_count);
+int bpf_queue_command(enum bpf_command_type type, int value);
+int bpf_apply_commands();
+int bpf_attach_device(int hid_id, int fn_lock);
+void bpf_detach_device(int hid_id);
+int bpf_events_fd();
+int bpf_consume_events();
+void cleanup_bpf();
+int print_bpf_stats();
+int print_bpf_status(int watch);
+void bpf_publish_fn_lock(int hid_id, int fn_lock);
+void bpf_publish_counters();
+int bpf_send_fn_lock(int hid_id, int fn_lock);
+int bpf_set_fn_lock(int hid_id, int fn_lock);
+int bpf_query_fn_lock(int hid_id);
+int bpf_unpin_all();
 
 #endif //HIDTEST3_LOADER_H
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "config.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/**
+ * Read the config file, e.g.
+ *   [remap]
+ *   # original scancode = new scancode, in hex
+ *   4e = 5c
+ *   [settings]
+ *   debug = 1
+ * Unknown sections are skipped so newer files still load.
+ * @param path: the config file
+ * @param config: filled with the settings, left untouched if the file is malformed
+ * @return 0 on success or if the file doesn't exist (empty config), -1 if it couldn't be read or parsed
+ */
+int load_config(const char *path, config_t *config)
+{
+    config_t parsed = { .debug_level = -1 };
+    char line[256], section[32] = "";
+    int line_number = 0, err = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        if (errno != ENOENT)
+        {
+            perror("Failed to open config");
+            return -1;
+        }
+        *config = parsed;
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        char *text = line + strspn(line, " \t");
+        unsigned int from, to;
+
+        line_number++;
+        if (text[0] == '#' || text[0] == '\n' || text[0] == '\0')
+            continue;
+        if (sscanf(text, "[%31[^]]]", section) == 1)
+            continue;
+        if (strcmp(section, "settings") == 0)
+        {
+            if (sscanf(text, "debug = %d", &parsed.debug_level) != 1 || parsed.debug_level < 0)
+            {
+                fprintf(stderr, "%s:%d: expected \"debug = 0\" or \"debug = 1\"\n", path, line_number);
+                err = -1;
+                break;
+            }
+            continue;
+        }
+        if (strcmp(section, "remap") != 0)
+            continue;
+
+        if (sscanf(text, "%x = %x", &from, &to) != 2)
+        {
+            fprintf(stderr, "%s:%d: expected \"scancode = scancode\"\n", path, line_number);
+            err = -1;
+            break;
+        }
+        if (parsed.remap_count >= MAX_CONFIG_REMAPS)
+        {
+            fprintf(stderr, "%s:%d: too many remaps\n", path, line_number);
+            err = -1;
+            break;
+        }
+        parsed.remaps[parsed.remap_count * 2] = from;
+        parsed.remaps[parsed.remap_count * 2 + 1] = to;
+        parsed.remap_count++;
+    }
+    fclose(fp);
+
+    if (err == 0)
+        *config = parsed;
+    return err;
+}
@@ -0,0 +1,17 @@
+#ifndef HIDTEST3_CONFIG_H
+#define HIDTEST3_CONFIG_H
+
+#define CONFIG_DIR "/etc/pxFnLock"
+#define CONFIG_NAME "config"
+#define CONFIG_PATH CONFIG_DIR "/" CONFIG_NAME
+#define MAX_CONFIG_REMAPS 64
+
+typedef struct {
+    int remaps[MAX_CONFIG_REMAPS * 2]; // pairs of original scancode, new scancode
+    int remap_count;
+    int debug_level; // [settings] debug, DEBUG_LEVEL_* or -1 when not set
+} config_t;
+
+int load_config(const char *path, config_t *config);
+
+#endif //HIDTEST3_CONFIG_H
@@ -0,0 +1,184 @@
+#include "device_profile.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "hid_descriptor.h"
+
+/*
+ * Built in profiles, more are appended from DEVICE_PROFILES_PATH.
+ * For the remaps:
+ * 1. use hid-recorder to find the original scancode from the keyboard
+ * 2. read the hid-asus.c file to see what scancodes are recognized by the driver
+ * 3. remap the original scancode to one that is detected by the driver but isn't used for anything on yours
+ * 4. you can now use that keycode and bind functions using keyd or any other tool
+ */
+static device_profile_t profiles[MAX_PROFILES] = {
+    {
+        .name = "proart-keyboard",
+        .vendor = 0x0b05,
+        .product = 0x19b6,
+        .usage_page = 0xff31,
+        .report_id = HOTKEY_REPORT_ID,
+        .fn_lock_report = {
+            .report_id = FN_LOCK_REPORT_ID,
+            .cmd = FN_LOCK_REPORT_CMD,
+            .sub = FN_LOCK_REPORT_SUB,
+            .state_offset = FN_LOCK_REPORT_STATE_OFFSET,
+            .size = FN_LOCK_REPORT_SIZE,
+        },
+        .remaps = {
+            0x4e, 0x5c, // fn-lock (fn + esc) -> key_prog3
+            0x7e, 0xba, // emoji picker key -> key_prog2
+            0x8b, 0x38, // proart hub key -> key_prog1
+        },
+        .remap_count = 3,
+    },
+};
+static int profile_count = 1;
+
+/**
+ * Parse the remaps column of a profile line, "4e:5c,7e:ba" or "-" for none
+ * @return 0 on success, -1 if the column is malformed
+ */
+static int parse_remaps(char *column, device_profile_t *profile)
+{
+    profile->remap_count = 0;
+    if (strcmp(column, "-") == 0)
+        return 0;
+
+    for (char *pair = strtok(column, ","); pair != NULL; pair = strtok(NULL, ","))
+    {
+        unsigned int from, to;
+        if (profile->remap_count >= MAX_PROFILE_REMAPS || sscanf(pair, "%x:%x", &from, &to) != 2)
+            return -1;
+        profile->remaps[profile->remap_count * 2] = from;
+        profile->remaps[profile->remap_count * 2 + 1] = to;
+        profile->remap_count++;
+    }
+    return 0;
+}
+
+/**
+ * Append the profiles listed in a file, one per line:
+ * name vid:pid usage_page report_id fn_lock_report remaps
+ * e.g. "proart-keyboard 0B05:19B6 ff31 5a 5a:d0:4e:3:63 4e:5c,7e:ba,8b:38"
+ * Numbers are hex except the fn lock report's state offset and size, lines starting with # are skipped.
+ * @param path: the profiles file
+ * @return 0 on success or if the file doesn't exist, -1 if it couldn't be read
+ */
+int load_device_profiles(const char *path)
+{
+    char line[512];
+    int line_number = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (fp == NULL)
+    {
+        if (errno == ENOENT)
+            return 0;
+        perror("Failed to open device profiles");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), fp) != NULL)
+    {
+        device_profile_t profile = {};
+        struct fn_lock_report_layout *layout = &profile.fn_lock_report;
+        char remaps[256] = "-";
+
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n')
+            continue;
+
+        if (sscanf(line, "%31s %hx:%hx %x %hhx %hhx:%hhx:%hhx:%hhu:%hhu %255s",
+                profile.name, &profile.vendor, &profile.product, &profile.usage_page, &profile.report_id,
+                &layout->report_id, &layout->cmd, &layout->sub, &layout->state_offset, &layout->size, remaps) < 10 ||
+            layout->size == 0 || layout->size > FN_LOCK_REPORT_SIZE || layout->state_offset >= layout->size ||
+            parse_remaps(remaps, &profile))
+        {
+            fprintf(stderr, "%s:%d: ignoring malformed profile\n", path, line_number);
+            continue;
+        }
+        if (profile_count >= MAX_PROFILES)
+        {
+            fprintf(stderr, "%s:%d: too many profiles\n", path, line_number);
+            break;
+        }
+        profiles[profile_count++] = profile;
+        printf("Loaded device profile %s\n", profile.name);
+    }
+    fclose(fp);
+    return 0;
+}
+
+/**
+ * @param index: a profile index from match_device_profile
+ * @return the profile, nullptr if the index is out of range
+ */
+const device_profile_t *get_device_profile(int index)
+{
+    if (index < 0 || index >= profile_count)
+        return nullptr;
+    return &profiles[index];
+}
+
+/**
+ * Check whether any profile covers a device, used to skip unrelated devices before reading their descriptor
+ * @return 1 if a profile has these ids, 0 otherwise
+ */
+int device_profile_known(unsigned short vendor, unsigned short product)
+{
+    for (int i = 0; i < profile_count; i++)
+    {
+        if (profiles[i].vendor == vendor && profiles[i].product == product)
+            return 1;
+    }
+    return 0;
+}
+
+struct match_ctx {
+    __u32 candidates; // bit per profile with matching ids
+    int match;
+};
+
+static int on_report_id(__u32 usage_page, __u8 report_id, void *ctx)
+{
+    struct match_ctx *match = ctx;
+
+    for (int i = 0; i < profile_count; i++)
+    {
+        if ((match->candidates & (1U << i)) &&
+            profiles[i].usage_page == usage_page && profiles[i].report_id == report_id)
+        {
+            match->match = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Find the profile of a device. The descriptor is parsed once and every Report ID is checked
+ * against the profiles with the device's ids, so adding profiles for other models costs nothing here.
+ * @param vendor: the device's vendor id
+ * @param product: the device's product id
+ * @param descriptor: the device's report descriptor
+ * @param size: size of descriptor
+ * @return the profile index, -1 if no profile matches
+ */
+int match_device_profile(unsigned short vendor, unsigned short product, const __u8 *descriptor, size_t size)
+{
+    struct match_ctx match = { .match = -1 };
+
+    for (int i = 0; i < profile_count; i++)
+    {
+        if (profiles[i].vendor == vendor && profiles[i].product == product)
+            match.candidates |= 1U << i;
+    }
+    if (match.candidates == 0)
+        return -1;
+
+    if (parse_report_descriptor(descriptor, size, on_report_id, &match))
+        return -1;
+    return match.match;
+}
@@ -0,0 +1,31 @@
+#ifndef HIDTEST3_DEVICE_PROFILE_H
+#define HIDTEST3_DEVICE_PROFILE_H
+
+#include <stddef.h>
+#include "bpf/common.h"
+
+#define MAX_PROFILES 16
+#define MAX_PROFILE_REMAPS 16
+#define DEVICE_PROFILES_PATH "/etc/pxFnLock/profiles"
+
+/*
+ * Everything that differs between keyboard models.
+ * A device matches when its ids match and its report descriptor has report_id inside usage_page.
+ */
+typedef struct {
+    char name[32];
+    unsigned short vendor;
+    unsigned short product;
+    __u32 usage_page; // vendor usage page of the hotkey collection
+    __u8 report_id;   // hotkey report id in that page, the program remaps this report
+    struct fn_lock_report_layout fn_lock_report;
+    int remaps[MAX_PROFILE_REMAPS * 2]; // pairs of original scancode, new scancode
+    int remap_count;
+} device_profile_t;
+
+int load_device_profiles(const char *path);
+const device_profile_t *get_device_profile(int index);
+int device_profile_known(unsigned short vendor, unsigned short product);
+int match_device_profile(unsigned short vendor, unsigned short product, const __u8 *descriptor, size_t size);
+
+#endif //HIDTEST3_DEVICE_PROFILE_H
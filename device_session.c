@@ -0,0 +1,262 @@
+#include "device_session.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include "discovery.h"
+
+/**
+ * Look the session's device up again if there's no valid result, caller holds the lock.
+ * Only the device the session was given is checked, other keyboards have their own session.
+ * @return 0 on success, -1 on failure
+ */
+static int ensure_discovered(device_session_t *session)
+{
+    hid_device_info_t info;
+
+    if (session->discovered)
+        return 0;
+
+    if (session->info.hid_path[0] == '\0' || match_hid_device(session->info.hid_path, &info))
+    {
+        printf("Failed to find hid\n");
+        return -1;
+    }
+    session->info = info;
+    if (find_hid_devices_paths(session->info.hid_path, &session->paths))
+    {
+        fprintf(stderr, "Failed to find HID devices\n");
+        return -1;
+    }
+    session->discovered = 1;
+    return 0;
+}
+
+/**
+ * Close the fds and forget the discovery result, caller holds the lock
+ */
+static void invalidate_locked(device_session_t *session)
+{
+    if (session->hidraw_fd >= 0)
+        close(session->hidraw_fd);
+    if (session->evdev_fd >= 0)
+        close(session->evdev_fd);
+    session->hidraw_fd = -1;
+    session->evdev_fd = -1;
+    session->discovered = 0;
+}
+
+/**
+ * Close only the hidraw fd and look the device up again on the next use, caller holds the lock.
+ * Used by the feature report worker: the evdev fd is in the main thread's event loop, so only the
+ * main thread closes it, through device_session_invalidate, once evdev reports the device gone.
+ */
+static void invalidate_hidraw_locked(device_session_t *session)
+{
+    if (session->hidraw_fd >= 0)
+        close(session->hidraw_fd);
+    session->hidraw_fd = -1;
+    session->discovered = 0;
+}
+
+/**
+ * Set up a session without a device, one is given to it with device_session_adopt
+ * @param session: the session to initialize
+ */
+void device_session_init(device_session_t *session)
+{
+    memset(session, 0, sizeof(*session));
+    session->hidraw_fd = -1;
+    session->evdev_fd = -1;
+    pthread_mutex_init(&session->lock, nullptr);
+}
+
+/**
+ * Get the evdev fd, opening it on first use
+ * @return the fd on success, -1 on failure
+ */
+int device_session_evdev_fd(device_session_t *session)
+{
+    int fd = -1;
+
+    pthread_mutex_lock(&session->lock);
+    if (session->evdev_fd < 0 && ensure_discovered(session) == 0)
+    {
+        session->evdev_fd = open(session->paths.input_device, O_RDONLY | O_CLOEXEC);
+        if (session->evdev_fd < 0)
+            perror("Failed to open evdev device");
+    }
+    fd = session->evdev_fd;
+    pthread_mutex_unlock(&session->lock);
+    return fd;
+}
+
+/**
+ * Send a feature report on the cached hidraw fd.
+ * If the device went away the session is rediscovered and the report is sent once more.
+ * The evdev fd is left open, the thread that watches it notices the device is gone on its own.
+ * @param report: the report, starting with the report id
+ * @param size: size of report
+ * @return 0 on success, -1 on failure with errno set
+ */
+int device_session_send_feature(device_session_t *session, unsigned char *report, int size)
+{
+    int res = -1, saved_errno = ENODEV;
+
+    pthread_mutex_lock(&session->lock);
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (ensure_discovered(session))
+            break;
+
+        if (session->hidraw_fd < 0)
+        {
+            session->hidraw_fd = open(session->paths.hidraw_device, O_RDWR | O_CLOEXEC);
+            if (session->hidraw_fd < 0)
+            {
+                saved_errno = errno;
+                perror("Failed to open hidraw device");
+                invalidate_hidraw_locked(session);
+                continue;
+            }
+        }
+
+        res = ioctl(session->hidraw_fd, HIDIOCSFEATURE(size), report);
+        saved_errno = errno;
+        if (res >= 0)
+            break;
+
+        // the node is stale after a disconnect, everything has to be looked up again
+        if (saved_errno != ENODEV && saved_errno != ENOENT && saved_errno != EBADF)
+            break;
+        printf("hidraw device gone, rediscovering\n");
+        invalidate_hidraw_locked(session);
+    }
+    pthread_mutex_unlock(&session->lock);
+
+    if (res < 0)
+    {
+        errno = saved_errno;
+        return -1;
+    }
+    printf("Sent feature report (%d bytes)\n", res);
+    return 0;
+}
+
+/**
+ * Switch the session to a device, e.g. one returned by find_hid_ids or announced by a hotplug uevent.
+ * The old fds are closed, the new nodes are opened on first use.
+ * @param info: the matched HID device
+ * @param paths: the device's nodes if already known (e.g. from the discovery cache), nullptr to look them up
+ * @return 0 on success, -1 if the device's nodes couldn't be found
+ */
+int device_session_adopt(device_session_t *session, const hid_device_info_t *info, const hid_sub_paths_t *paths)
+{
+    int err = 0;
+
+    pthread_mutex_lock(&session->lock);
+    invalidate_locked(session);
+    session->info = *info;
+    if (paths != nullptr)
+    {
+        session->paths = *paths;
+        session->discovered = 1;
+    }
+    else if (find_hid_devices_paths(session->info.hid_path, &session->paths))
+    {
+        fprintf(stderr, "Failed to find HID devices\n");
+        err = -1;
+    }
+    else
+        session->discovered = 1;
+    pthread_mutex_unlock(&session->lock);
+    return err;
+}
+
+/**
+ * Get the HID device ID of the session's device, safe to call while the main thread adopts or releases it
+ * @return the id, -1 if the session has no device
+ */
+int device_session_hid_id(device_session_t *session)
+{
+    int hid_id;
+
+    pthread_mutex_lock(&session->lock);
+    hid_id = session->info.hid_path[0] != '\0' ? session->info.hid_id : -1;
+    pthread_mutex_unlock(&session->lock);
+    return hid_id;
+}
+
+/**
+ * Close the fds and look the device up again on the next use, e.g. after the evdev node reported ENODEV
+ */
+void device_session_invalidate(device_session_t *session)
+{
+    pthread_mutex_lock(&session->lock);
+    invalidate_locked(session);
+    pthread_mutex_unlock(&session->lock);
+}
+
+/**
+ * Close the fds and forget the device, e.g. after it was unplugged.
+ * The session is unused until the next device_session_adopt.
+ */
+void device_session_release(device_session_t *session)
+{
+    pthread_mutex_lock(&session->lock);
+    invalidate_locked(session);
+    memset(&session->info, 0, sizeof(session->info));
+    pthread_mutex_unlock(&session->lock);
+}
+
+/**
+ * Close the fds, the session can't be used afterwards
+ */
+void device_session_close(device_session_t *session)
+{
+    device_session_invalidate(session);
+    pthread_mutex_destroy(&session->lock);
+}
+
+/**
+ * Ask evdev to only deliver some keys, every other key press then stays in the kernel
+ * and doesn't wake the reader. Empty SYN_REPORT frames are dropped by evdev as well.
+ * @param evdev_fd: an open evdev fd
+ * @param keys: the KEY_* codes to deliver
+ * @param count: number of entries in keys
+ * @return 0 on success, -1 if the kernel doesn't support event masks
+ */
+int device_session_mask_evdev(int evdev_fd, const int *keys, int count)
+{
+    unsigned long type_bits[EV_CNT / (8 * sizeof(unsigned long)) + 1] = {};
+    unsigned long key_bits[KEY_CNT / (8 * sizeof(unsigned long)) + 1] = {};
+    const int bits_per_long = 8 * sizeof(unsigned long);
+
+    type_bits[EV_SYN / bits_per_long] |= 1UL << (EV_SYN % bits_per_long);
+    type_bits[EV_KEY / bits_per_long] |= 1UL << (EV_KEY % bits_per_long);
+    for (int i = 0; i < count; i++)
+        key_bits[keys[i] / bits_per_long] |= 1UL << (keys[i] % bits_per_long);
+
+    struct input_mask type_mask = {
+        .type = 0, // type 0 masks the event types themselves
+        .codes_size = sizeof(type_bits),
+        .codes_ptr = (uintptr_t)type_bits,
+    };
+    struct input_mask key_mask = {
+        .type = EV_KEY,
+        .codes_size = sizeof(key_bits),
+        .codes_ptr = (uintptr_t)key_bits,
+    };
+
+    if (ioctl(evdev_fd, EVIOCSMASK, &type_mask) < 0 || ioctl(evdev_fd, EVIOCSMASK, &key_mask) < 0)
+    {
+        perror("Failed to set evdev event mask");
+        return -1;
+    }
+    return 0;
+}
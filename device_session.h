@@ -0,0 +1,32 @@
+#ifndef HIDTEST3_DEVICE_SESSION_H
+#define HIDTEST3_DEVICE_SESSION_H
+
+#include <pthread.h>
+#include "bpf/common.h"
+
+/*
+ * Owns one keyboard's device nodes for the lifetime of the process.
+ * Discovery runs once and the fds stay open, when the device goes away
+ * they are closed and the same device is looked up again on the next use.
+ * The evdev fd is only closed by the thread that watches it (device_session_invalidate, _release or _close).
+ */
+typedef struct {
+    int discovered; // info and paths are valid
+    hid_device_info_t info;
+    hid_sub_paths_t paths;
+    int hidraw_fd;
+    int evdev_fd;
+    pthread_mutex_t lock; // the hidraw fd is used from the feature report worker
+} device_session_t;
+
+void device_session_init(device_session_t *session);
+int device_session_evdev_fd(device_session_t *session);
+int device_session_send_feature(device_session_t *session, unsigned char *report, int size);
+int device_session_adopt(device_session_t *session, const hid_device_info_t *info, const hid_sub_paths_t *paths);
+int device_session_hid_id(device_session_t *session);
+void device_session_invalidate(device_session_t *session);
+void device_session_release(device_session_t *session);
+void device_session_close(device_session_t *session);
+int device_session_mask_evdev(int evdev_fd, const int *keys, int count);
+
+#endif //HIDTEST3_DEVICE_SESSION_H
@@ -0,0 +1,244 @@
+#include "discovery.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <glob.h>
+#include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/hidraw.h>
+#include "device_profile.h"
+
+/**
+ * Find the first path matching a pattern and build a device node path from its name
+ * @param pattern: glob pattern
+ * @param out: MAX_PATH buffer, set to prefix followed by the last component of the match
+ * @param prefix: the node's directory, e.g. "/dev/"
+ * @return 0 if something matched, -1 otherwise
+ */
+static int glob_first(const char *pattern, char *out, const char *prefix)
+{
+    glob_t matches;
+    int err = -1;
+
+    if (glob(pattern, GLOB_NOSORT, nullptr, &matches) == 0 && matches.gl_pathc > 0)
+    {
+        const char *name = strrchr(matches.gl_pathv[0], '/') + 1;
+        snprintf(out, MAX_PATH, "%s%s", prefix, name);
+        err = 0;
+    }
+    globfree(&matches);
+    return err;
+}
+
+/**
+ * Find the first input device and hidraw device associated with a HID device
+ * @param hid_path: The HID sysfs path (e.g., "/sys/bus/hid/devices/0003:0B05:19B6.0002")
+ * @param devices: Structure to store found device paths
+ * @return 0 on success, -1 on error
+ */
+int find_hid_devices_paths(const char *hid_path, hid_sub_paths_t *devices) {
+    char pattern[MAX_PATH];
+    struct stat st;
+
+    // Initialize the structure
+    memset(devices, 0, sizeof(hid_sub_paths_t));
+
+    // Check if the HID path exists
+    if (stat(hid_path, &st) != 0) {
+        fprintf(stderr, "HID path does not exist: %s\n", hid_path);
+        return -1;
+    }
+
+    // one glob per node instead of walking the directories
+    snprintf(pattern, sizeof(pattern), "%s/hidraw/hidraw*", hid_path);
+    glob_first(pattern, devices->hidraw_device, "/dev/");
+
+    snprintf(pattern, sizeof(pattern), "%s/input/input*/event*", hid_path);
+    glob_first(pattern, devices->input_device, "/dev/input/");
+
+    return 0;
+}
+
+/**
+ * Read the bus, vendor and product ids from a HID device's sysfs name, e.g. 0003:0B05:19B6.0002
+ * @return 0 on success, -1 if the name isn't a HID device name
+ */
+static int parse_hid_name(const char *hid_path, unsigned short *vendor, unsigned short *product)
+{
+    const char *name = strrchr(hid_path, '/');
+    unsigned int bus;
+
+    name = name ? name + 1 : hid_path;
+    return sscanf(name, "%x:%hx:%hx.", &bus, vendor, product) == 3 ? 0 : -1;
+}
+
+/**
+ * Fill the id and path of a HID device from its sysfs path
+ * @param hid_path: sysfs path of the device, the name ends in the hex id
+ * @return 0 on success, -1 if the path has no id
+ */
+static int fill_info(const char *hid_path, int profile, hid_device_info_t *info)
+{
+    // extract the id, the hex number after the last period in the directory name
+    const char *colon_pos = strrchr(hid_path, '.');
+    if (colon_pos == NULL)
+        return -1;
+    info->hid_id = strtol(colon_pos + 1, NULL, 16);
+    info->profile = profile;
+    snprintf(info->hid_path, sizeof(info->hid_path), "%s", hid_path);
+    return 0;
+}
+
+/**
+ * Check whether a HID device is a keyboard's vendor interface, the one that carries its profile's hotkey report
+ * @param hid_path: sysfs path of the device, e.g. /sys/bus/hid/devices/0003:0B05:19B6.0002
+ * @param info: filled with the id, path and profile if the device matches
+ * @return 0 if it matches, -1 otherwise
+ */
+int match_hid_device(const char *hid_path, hid_device_info_t *info) {
+    unsigned short vendor, product;
+    if (parse_hid_name(hid_path, &vendor, &product) || !device_profile_known(vendor, product))
+        return -1;
+
+    char full_path[MAX_PATH];
+    snprintf(full_path, sizeof(full_path), "%s/report_descriptor", hid_path);
+    FILE *fp = fopen(full_path, "rb");
+    if (fp == NULL)
+    {
+        printf("cannot open device %s\n", full_path);
+        return -1;
+    }
+
+    // read first 4kb of the report descriptor
+    unsigned char report_descriptor[4096];
+    size_t bytes_read = fread(report_descriptor, 1, sizeof(report_descriptor), fp);
+    fclose(fp);
+    if (bytes_read <= 0) {
+        printf("Failed to read report descriptor for device %s\n", hid_path);
+        return -1;
+    }
+
+    int profile = match_device_profile(vendor, product, report_descriptor, bytes_read);
+    if (profile < 0)
+        return -1;
+    return fill_info(hid_path, profile, info);
+}
+
+/**
+ * Find every HID device with a device profile by walking /sys/bus/hid/devices and reading each candidate's report descriptor
+ * @param infos: filled with up to max devices
+ * @param max: size of infos
+ * @return the number of devices found, -1 if sysfs couldn't be read
+ */
+int find_hid_ids_sysfs(hid_device_info_t *infos, int max) {
+    const char *hid_path = "/sys/bus/hid/devices";
+    DIR *dir;
+    struct dirent *entry;
+    int count = 0;
+
+    dir = opendir(hid_path);
+    if (dir == NULL) {
+        perror("Failed to open /sys/bus/hid/devices");
+        return -1;
+    }
+
+    while (count < max && (entry = readdir(dir)) != NULL) {
+        // Skip . and .. directories
+        if (strcmp(entry->d_name, ".") == 0 ||
+            strcmp(entry->d_name, "..") == 0) {
+            continue;
+            }
+
+        // the ids in the name are checked before the report descriptor is read
+        char full_path[MAX_PATH];
+        snprintf(full_path, sizeof(full_path), "%s/%s", hid_path, entry->d_name);
+        if (match_hid_device(full_path, &infos[count]) == 0)
+            count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/**
+ * Check one hidraw node, filtering on the ids before the descriptor is fetched
+ * @param node: the hidraw node name, e.g. "hidraw3"
+ * @param info: filled with the id, sysfs path and profile if the node matches
+ * @return 0 if it matches, -1 otherwise
+ */
+static int match_hidraw(const char *node, hid_device_info_t *info)
+{
+    struct hidraw_devinfo devinfo;
+    struct hidraw_report_descriptor descriptor;
+    char path[MAX_PATH], hid_path[PATH_MAX];
+    int fd, profile = -1;
+
+    snprintf(path, sizeof(path), "/dev/%s", node);
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (ioctl(fd, HIDIOCGRAWINFO, &devinfo) == 0 &&
+        device_profile_known(devinfo.vendor, devinfo.product) &&
+        ioctl(fd, HIDIOCGRDESCSIZE, &descriptor.size) == 0 &&
+        ioctl(fd, HIDIOCGRDESC, &descriptor) == 0)
+    {
+        profile = match_device_profile(devinfo.vendor, devinfo.product, descriptor.value, descriptor.size);
+    }
+    close(fd);
+    if (profile < 0)
+        return -1;
+
+    // the node's device link points at the hid device, one realpath gives its sysfs path
+    snprintf(path, sizeof(path), "/sys/class/hidraw/%s/device", node);
+    if (realpath(path, hid_path) == NULL)
+        return -1;
+    return fill_info(hid_path, profile, info);
+}
+
+/**
+ * Find every HID device with a device profile by asking the /dev/hidraw* nodes for their ids and report descriptor
+ * @param infos: filled with up to max devices
+ * @param max: size of infos
+ * @return the number of devices found, -1 if the nodes couldn't be enumerated
+ */
+int find_hid_ids_hidraw(hid_device_info_t *infos, int max) {
+    DIR *dir;
+    struct dirent *entry;
+    int count = 0;
+
+    dir = opendir("/dev");
+    if (dir == NULL) {
+        perror("Failed to open /dev");
+        return -1;
+    }
+
+    while (count < max && (entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "hidraw", 6) != 0)
+            continue;
+        if (match_hidraw(entry->d_name, &infos[count]) == 0)
+            count++;
+    }
+    closedir(dir);
+    return count;
+}
+
+/**
+ * Find every keyboard interface that matches a device profile.
+ * The hidraw nodes are asked first, sysfs is walked if that finds nothing (e.g. hidraw isn't loaded).
+ * @param infos: filled with up to max devices
+ * @param max: size of infos
+ * @return the number of devices found, -1 on error
+ */
+int find_hid_ids(hid_device_info_t *infos, int max) {
+    int count = find_hid_ids_hidraw(infos, max);
+
+    if (count <= 0)
+        count = find_hid_ids_sysfs(infos, max);
+    if (count == 0)
+        printf("No suitable HID device found\n");
+    return count;
+}
@@ -0,0 +1,12 @@
+#ifndef HIDTEST3_DISCOVERY_H
+#define HIDTEST3_DISCOVERY_H
+
+#include "bpf/common.h"
+
+int find_hid_devices_paths(const char *hid_path, hid_sub_paths_t *devices);
+int match_hid_device(const char *hid_path, hid_device_info_t *info);
+int find_hid_ids_sysfs(hid_device_info_t *infos, int max);
+int find_hid_ids_hidraw(hid_device_info_t *infos, int max);
+int find_hid_ids(hid_device_info_t *infos, int max);
+
+#endif //HIDTEST3_DISCOVERY_H
@@ -0,0 +1,225 @@
+#include "discovery_cache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/hidraw.h>
+#include "device_profile.h"
+
+#define CACHE_MAGIC 0x70786463 // "pxdc"
+#define CACHE_VERSION 2
+
+struct cache_header {
+    __u32 magic;
+    __u32 version;
+    __u32 count;
+};
+
+struct cache_entry {
+    hid_device_info_t info;
+    hid_sub_paths_t paths;
+    __u64 hidraw_rdev;     // device number of the hidraw node
+    __u64 descriptor_hash; // FNV-1a of the report descriptor
+};
+
+/**
+ * Read a hidraw node's ids, device number and report descriptor hash
+ * @param hidraw: path of the hidraw node
+ * @param devinfo: filled with the HIDIOCGRAWINFO result
+ * @param rdev: filled with the node's device number
+ * @param hash: filled with the FNV-1a hash of the report descriptor
+ * @return 0 on success, -1 on failure
+ */
+static int describe_hidraw(const char *hidraw, struct hidraw_devinfo *devinfo, __u64 *rdev, __u64 *hash)
+{
+    struct hidraw_report_descriptor descriptor;
+    struct stat st;
+    int fd, err = -1;
+
+    fd = open(hidraw, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    if (fstat(fd, &st) == 0 && S_ISCHR(st.st_mode) &&
+        ioctl(fd, HIDIOCGRAWINFO, devinfo) == 0 &&
+        ioctl(fd, HIDIOCGRDESCSIZE, &descriptor.size) == 0 &&
+        ioctl(fd, HIDIOCGRDESC, &descriptor) == 0)
+    {
+        *rdev = st.st_rdev;
+        *hash = 0xcbf29ce484222325ULL;
+        for (__u32 i = 0; i < descriptor.size; i++)
+            *hash = (*hash ^ descriptor.value[i]) * 0x100000001b3ULL;
+        err = 0;
+    }
+    close(fd);
+    return err;
+}
+
+/**
+ * Save the resolved keyboards so the restore oneshot can skip discovery
+ * @param infos: the keyboards' HID devices
+ * @param paths: the keyboards' hidraw and evdev nodes, same order as infos
+ * @param count: number of keyboards
+ * @return 0 on success, -1 on failure
+ */
+int write_discovery_cache(const hid_device_info_t *infos, const hid_sub_paths_t *paths, int count)
+{
+    char tmp_path[] = DISCOVERY_CACHE_PATH ".XXXXXX";
+    struct cache_header header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .count = 0,
+    };
+    struct cache_entry entries[MAX_DEVICES] = {};
+    struct stat st;
+
+    for (int i = 0; i < count && i < MAX_DEVICES; i++)
+    {
+        struct cache_entry *entry = &entries[header.count];
+        struct hidraw_devinfo devinfo;
+
+        if (describe_hidraw(paths[i].hidraw_device, &devinfo, &entry->hidraw_rdev, &entry->descriptor_hash))
+            continue;
+        entry->info = infos[i];
+        entry->paths = paths[i];
+        header.count++;
+    }
+
+    if (stat(DISCOVERY_CACHE_DIR, &st) != 0 && mkdir(DISCOVERY_CACHE_DIR, 0755) != 0)
+    {
+        perror("Failed to create cache directory");
+        return -1;
+    }
+
+    // the daemon and the restore oneshot can both write the cache, each gets its own temporary file
+    int fd = mkstemp(tmp_path);
+    if (fd < 0)
+    {
+        perror("Failed to open discovery cache");
+        return -1;
+    }
+    if (fchmod(fd, 0644) != 0)
+    {
+        perror("Failed to set discovery cache permissions");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    size_t size = header.count * sizeof(entries[0]);
+    if (write(fd, &header, sizeof(header)) != sizeof(header) ||
+        write(fd, entries, size) != (ssize_t)size)
+    {
+        perror("Failed to write discovery cache");
+        close(fd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(fd);
+
+    // a restore running at the same time sees either the old or the new cache
+    if (rename(tmp_path, DISCOVERY_CACHE_PATH) != 0)
+    {
+        perror("Failed to replace discovery cache");
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Check that a cached keyboard is still the same device behind the same nodes
+ * @return 1 if the entry can be trusted, 0 otherwise
+ */
+static int entry_valid(const struct cache_entry *entry)
+{
+    const device_profile_t *profile = get_device_profile(entry->info.profile);
+    struct hidraw_devinfo devinfo;
+    char link[MAX_PATH];
+    __u64 rdev, hash;
+    struct stat st;
+    const char *node = strrchr(entry->paths.hidraw_device, '/');
+
+    // the hidraw node still belongs to the same hid device, whose id is part of the path
+    if (node == NULL || profile == nullptr)
+        return 0;
+    snprintf(link, sizeof(link), "%s/hidraw%s", entry->info.hid_path, node);
+    if (stat(link, &st) != 0)
+        return 0;
+
+    if (describe_hidraw(entry->paths.hidraw_device, &devinfo, &rdev, &hash))
+        return 0;
+    return rdev == entry->hidraw_rdev && hash == entry->descriptor_hash &&
+        (unsigned short)devinfo.vendor == profile->vendor && (unsigned short)devinfo.product == profile->product;
+}
+
+/**
+ * Load the keyboards saved by write_discovery_cache, after checking each one still matches its profile.
+ * The device profiles have to be loaded first.
+ * @param infos: filled with up to max devices
+ * @param paths: filled with the nodes of each device
+ * @param max: size of infos and paths
+ * @return the number of keyboards, -1 if there's no cache or any entry is stale
+ */
+int read_discovery_cache(hid_device_info_t *infos, hid_sub_paths_t *paths, int max)
+{
+    struct cache_header header;
+    struct cache_entry entry;
+    int count = -1;
+
+    int fd = open(DISCOVERY_CACHE_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        if (errno != ENOENT)
+            perror("Failed to open discovery cache");
+        return -1;
+    }
+
+    if (read(fd, &header, sizeof(header)) != sizeof(header) ||
+        header.magic != CACHE_MAGIC || header.version != CACHE_VERSION ||
+        header.count == 0 || header.count > (__u32)max)
+    {
+        close(fd);
+        return -1;
+    }
+
+    for (count = 0; count < (int)header.count; count++)
+    {
+        if (read(fd, &entry, sizeof(entry)) != sizeof(entry) || !entry_valid(&entry))
+        {
+            printf("discovery cache is stale\n");
+            count = -1;
+            break;
+        }
+        infos[count] = entry.info;
+        paths[count] = entry.paths;
+    }
+    close(fd);
+    return count;
+}
+
+/**
+ * Peek at the profile of the first cached keyboard without checking the entry, e.g. to start loading
+ * the bpf program for the likely model while discovery is still running
+ * @return the profile index, -1 if there's no usable cache
+ */
+int cached_device_profile()
+{
+    struct cache_header header;
+    struct cache_entry entry;
+    int profile = -1;
+
+    int fd = open(DISCOVERY_CACHE_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    if (read(fd, &header, sizeof(header)) == sizeof(header) &&
+        header.magic == CACHE_MAGIC && header.version == CACHE_VERSION && header.count > 0 &&
+        read(fd, &entry, sizeof(entry)) == sizeof(entry) && get_device_profile(entry.info.profile) != nullptr)
+        profile = entry.info.profile;
+    close(fd);
+    return profile;
+}
@@ -0,0 +1,14 @@
+#ifndef HIDTEST3_DISCOVERY_CACHE_H
+#define HIDTEST3_DISCOVERY_CACHE_H
+
+#include "bpf/common.h"
+
+// device ids and nodes don't survive a reboot, so the cache lives on tmpfs
+#define DISCOVERY_CACHE_DIR "/run/pxFnLock"
+#define DISCOVERY_CACHE_PATH DISCOVERY_CACHE_DIR "/discovery"
+
+int write_discovery_cache(const hid_device_info_t *infos, const hid_sub_paths_t *paths, int count);
+int read_discovery_cache(hid_device_info_t *infos, hid_sub_paths_t *paths, int max);
+int cached_device_profile();
+
+#endif //HIDTEST3_DISCOVERY_CACHE_H
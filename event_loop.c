@@ -0,0 +1,149 @@
+#include "event_loop.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#define MAX_SOURCES 16
+#define MAX_EVENTS_PER_WAIT 8
+
+typedef struct {
+    int fd;
+    event_handler_t handler;
+    void *ctx;
+} event_source_t;
+
+static int epoll_fd = -1;
+static int running = 0;
+static int exit_status = 0;
+static event_source_t sources[MAX_SOURCES];
+
+/**
+ * Create the epoll instance, must be called before any other event_loop function
+ * @return 0 on success, -1 on failure
+ */
+int event_loop_init()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        perror("Failed to create epoll instance");
+        return -1;
+    }
+    for (int i = 0; i < MAX_SOURCES; i++)
+        sources[i].fd = -1;
+    return 0;
+}
+
+/**
+ * Register an fd, the handler is called every time it becomes readable
+ * @param fd: the fd to watch
+ * @param handler: function to call when fd is readable
+ * @param ctx: passed to the handler as is
+ * @return 0 on success, -1 on failure
+ */
+int event_loop_add(int fd, event_handler_t handler, void *ctx)
+{
+    event_source_t *source = nullptr;
+    for (int i = 0; i < MAX_SOURCES; i++)
+    {
+        if (sources[i].fd < 0)
+        {
+            source = &sources[i];
+            break;
+        }
+    }
+    if (!source)
+    {
+        fprintf(stderr, "Too many event sources\n");
+        return -1;
+    }
+
+    struct epoll_event ev = {
+        .events = EPOLLIN,
+        .data.ptr = source,
+    };
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        perror("Failed to add fd to epoll");
+        return -1;
+    }
+
+    source->fd = fd;
+    source->handler = handler;
+    source->ctx = ctx;
+    return 0;
+}
+
+/**
+ * Stop watching an fd, the fd itself is left open
+ * @param fd: a previously registered fd
+ * @return 0 on success, -1 if the fd isn't registered
+ */
+int event_loop_remove(int fd)
+{
+    for (int i = 0; i < MAX_SOURCES; i++)
+    {
+        if (sources[i].fd == fd)
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+            sources[i].fd = -1;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Dispatch events until event_loop_stop is called.
+ * There is no timeout, the process sleeps until one of the fds is readable.
+ * @return the status passed to event_loop_stop, -1 if epoll fails
+ */
+int event_loop_run()
+{
+    struct epoll_event events[MAX_EVENTS_PER_WAIT];
+
+    running = 1;
+    while (running)
+    {
+        int count = epoll_wait(epoll_fd, events, MAX_EVENTS_PER_WAIT, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return -1;
+        }
+
+        for (int i = 0; i < count && running; i++)
+        {
+            event_source_t *source = events[i].data.ptr;
+            // the source may have been removed by an earlier handler in this batch
+            if (source->fd < 0)
+                continue;
+            source->handler(source->fd, source->ctx);
+        }
+    }
+    return exit_status;
+}
+
+/**
+ * Make event_loop_run return after the current handler
+ * @param status: value returned by event_loop_run
+ */
+void event_loop_stop(int status)
+{
+    exit_status = status;
+    running = 0;
+}
+
+/**
+ * Close the epoll instance, registered fds are left open
+ */
+void event_loop_destroy()
+{
+    if (epoll_fd >= 0)
+        close(epoll_fd);
+    epoll_fd = -1;
+}
@@ -0,0 +1,18 @@
+#ifndef HIDTEST3_EVENT_LOOP_H
+#define HIDTEST3_EVENT_LOOP_H
+
+/**
+ * Called when a registered fd becomes readable
+ * @param fd: the readable fd
+ * @param ctx: the pointer passed to event_loop_add
+ */
+typedef void (*event_handler_t)(int fd, void *ctx);
+
+int event_loop_init();
+int event_loop_add(int fd, event_handler_t handler, void *ctx);
+int event_loop_remove(int fd);
+int event_loop_run();
+void event_loop_stop(int status);
+void event_loop_destroy();
+
+#endif //HIDTEST3_EVENT_LOOP_H
@@ -0,0 +1,187 @@
+#include "feature_report.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MAX_ATTEMPTS 5
+#define FIRST_RETRY_DELAY_MS 10 // doubled after every failed attempt
+
+static const char *setting_names[SETTING_COUNT] = {
+    [SETTING_FN_LOCK] = "fn_lock",
+};
+
+typedef struct {
+    int pending;
+    int value;
+    struct timespec queued_at; // when the oldest still pending write was queued
+} pending_setting_t;
+
+static pthread_t worker_thread;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static pending_setting_t queue[SETTING_COUNT];
+static int in_flight = 0; // settings taken by the worker but not sent yet
+static int stopping = 0;
+static int started = 0;
+static unsigned long coalesced = 0; // writes replaced before they were sent
+static feature_sender_t send_setting;
+static void *send_ctx;
+
+static double elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000.0 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+static int queue_depth()
+{
+    int depth = 0;
+    for (int i = 0; i < SETTING_COUNT; i++)
+        depth += queue[i].pending;
+    return depth;
+}
+
+/**
+ * Send a setting, retrying errors that mean the keyboard was briefly busy
+ * @return the number of attempts made, negative if every attempt failed
+ */
+static int send_with_retry(feature_setting_t setting, int value)
+{
+    int delay_ms = FIRST_RETRY_DELAY_MS;
+
+    for (int attempt = 1; attempt <= MAX_ATTEMPTS; attempt++)
+    {
+        if (send_setting(setting, value, send_ctx) == 0)
+            return attempt;
+        if (errno != EAGAIN && errno != EPIPE)
+            return -attempt;
+
+        struct timespec delay = {
+            .tv_sec = delay_ms / 1000,
+            .tv_nsec = (delay_ms % 1000) * 1000000L,
+        };
+        nanosleep(&delay, nullptr);
+        delay_ms *= 2;
+    }
+    return -MAX_ATTEMPTS;
+}
+
+static void *feature_worker(void *arg)
+{
+    pending_setting_t batch[SETTING_COUNT];
+
+    pthread_mutex_lock(&queue_lock);
+    while (1)
+    {
+        while (!stopping && queue_depth() == 0)
+            pthread_cond_wait(&queue_changed, &queue_lock);
+        if (queue_depth() == 0)
+            break;
+
+        // take everything that is pending, it's sent as one batch
+        int batch_size = queue_depth();
+        for (int i = 0; i < SETTING_COUNT; i++)
+        {
+            batch[i] = queue[i];
+            queue[i].pending = 0;
+        }
+        in_flight = batch_size;
+        pthread_mutex_unlock(&queue_lock);
+
+        for (int i = 0; i < SETTING_COUNT; i++)
+        {
+            if (!batch[i].pending)
+                continue;
+
+            int attempts = send_with_retry(i, batch[i].value);
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (attempts > 0)
+                printf("feature report %s=%d sent in %.2f ms (%d attempts, batch of %d)\n",
+                    setting_names[i], batch[i].value, elapsed_ms(&batch[i].queued_at, &now),
+                    attempts, batch_size);
+            else
+                printf("feature report %s=%d failed after %d attempts\n",
+                    setting_names[i], batch[i].value, -attempts);
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        in_flight = 0;
+        pthread_cond_broadcast(&queue_changed);
+    }
+    pthread_mutex_unlock(&queue_lock);
+    return nullptr;
+}
+
+/**
+ * Start the worker thread that sends feature reports
+ * @param sender: function doing the actual send
+ * @param ctx: passed to sender as is
+ * @return 0 on success, -1 on failure
+ */
+int feature_queue_start(feature_sender_t sender, void *ctx)
+{
+    send_setting = sender;
+    send_ctx = ctx;
+    stopping = 0;
+
+    if (pthread_create(&worker_thread, nullptr, feature_worker, nullptr) != 0)
+    {
+        perror("Failed to start feature report worker");
+        return -1;
+    }
+    started = 1;
+    return 0;
+}
+
+/**
+ * Queue a setting without waiting for it to be sent.
+ * A write that is still pending for the same setting is replaced, only the latest value is sent.
+ * @param setting: the setting to write
+ * @param value: the value to write
+ */
+void feature_queue_set(feature_setting_t setting, int value)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (queue[setting].pending)
+    {
+        coalesced++;
+    }
+    else
+    {
+        queue[setting].pending = 1;
+        clock_gettime(CLOCK_MONOTONIC, &queue[setting].queued_at);
+    }
+    queue[setting].value = value;
+    printf("feature queue depth %d (in flight %d, coalesced %lu)\n", queue_depth(), in_flight, coalesced);
+    pthread_cond_broadcast(&queue_changed);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Wait until every queued setting has been sent or has failed
+ */
+void feature_queue_flush()
+{
+    pthread_mutex_lock(&queue_lock);
+    while (started && (queue_depth() > 0 || in_flight > 0))
+        pthread_cond_wait(&queue_changed, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+}
+
+/**
+ * Send whatever is still queued and stop the worker thread
+ */
+void feature_queue_stop()
+{
+    if (!started)
+        return;
+
+    pthread_mutex_lock(&queue_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&queue_changed);
+    pthread_mutex_unlock(&queue_lock);
+
+    pthread_join(worker_thread, nullptr);
+    started = 0;
+}
@@ -0,0 +1,24 @@
+#ifndef HIDTEST3_FEATURE_REPORT_H
+#define HIDTEST3_FEATURE_REPORT_H
+
+// settings that are written to the keyboard with feature reports
+typedef enum {
+    SETTING_FN_LOCK,
+    SETTING_COUNT,
+} feature_setting_t;
+
+/**
+ * Sends one setting to the keyboard, called from the worker thread
+ * @param setting: which setting to send
+ * @param value: the value to send
+ * @param ctx: the pointer passed to feature_queue_start
+ * @return 0 on success, -1 on failure with errno set
+ */
+typedef int (*feature_sender_t)(feature_setting_t setting, int value, void *ctx);
+
+int feature_queue_start(feature_sender_t sender, void *ctx);
+void feature_queue_set(feature_setting_t setting, int value);
+void feature_queue_flush();
+void feature_queue_stop();
+
+#endif //HIDTEST3_FEATURE_REPORT_H
@@ -0,0 +1,76 @@
+#include "hid_descriptor.h"
+
+// short item prefixes with the size bits masked off, see HID 1.11 section 6.2.2
+#define ITEM_USAGE_PAGE 0x04
+#define ITEM_REPORT_ID 0x84
+#define ITEM_PUSH 0xa4
+#define ITEM_POP 0xb4
+#define ITEM_LONG 0xfe
+
+#define MAX_PUSH_DEPTH 8
+
+/**
+ * Walk a report descriptor item by item, tracking the usage page, and report every Report ID.
+ * Only the global state needed for that is kept, so the descriptor is read once without allocating.
+ * @param descriptor: the raw report descriptor
+ * @param size: size of descriptor
+ * @param handler: called for every Report ID item
+ * @param ctx: passed to handler
+ * @return 0 on success or when handler stopped the walk, -1 if the descriptor is malformed
+ */
+int parse_report_descriptor(const __u8 *descriptor, size_t size, hid_report_id_handler_t handler, void *ctx)
+{
+    __u32 usage_page = 0;
+    __u32 page_stack[MAX_PUSH_DEPTH];
+    int depth = 0;
+    size_t pos = 0;
+
+    while (pos < size)
+    {
+        __u8 prefix = descriptor[pos++];
+
+        // long items carry their own size byte and are never global items
+        if (prefix == ITEM_LONG)
+        {
+            if (pos + 2 > size)
+                return -1;
+            pos += 2 + descriptor[pos];
+            continue;
+        }
+
+        size_t len = prefix & 0x3;
+        if (len == 3)
+            len = 4;
+        if (pos + len > size)
+            return -1;
+
+        __u32 value = 0;
+        for (size_t i = 0; i < len; i++)
+            value |= (__u32)descriptor[pos + i] << (8 * i);
+        pos += len;
+
+        switch (prefix & 0xfc)
+        {
+        case ITEM_USAGE_PAGE:
+            usage_page = value;
+            break;
+        case ITEM_REPORT_ID:
+            if (handler(usage_page, value, ctx))
+                return 0;
+            break;
+        case ITEM_PUSH:
+            if (depth >= MAX_PUSH_DEPTH)
+                return -1;
+            page_stack[depth++] = usage_page;
+            break;
+        case ITEM_POP:
+            if (depth == 0)
+                return -1;
+            usage_page = page_stack[--depth];
+            break;
+        default:
+            break;
+        }
+    }
+    return pos == size ? 0 : -1;
+}
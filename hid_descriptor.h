@@ -0,0 +1,18 @@
+#ifndef HIDTEST3_HID_DESCRIPTOR_H
+#define HIDTEST3_HID_DESCRIPTOR_H
+
+#include <stddef.h>
+#include <linux/types.h>
+
+/**
+ * Called for every Report ID item of a report descriptor
+ * @param usage_page: the usage page in effect for the report
+ * @param report_id: the report id
+ * @param ctx: the pointer passed to parse_report_descriptor
+ * @return 0 to keep parsing, non zero to stop
+ */
+typedef int (*hid_report_id_handler_t)(__u32 usage_page, __u8 report_id, void *ctx);
+
+int parse_report_descriptor(const __u8 *descriptor, size_t size, hid_report_id_handler_t handler, void *ctx);
+
+#endif //HIDTEST3_HID_DESCRIPTOR_H
@@ -2,321 +2,997 @@
 #include <unistd.h>
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
-#include "bpf/hid_modify.skel.h"
 #include <stdlib.h>
-#include <dirent.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <linux/input.h>
 #include <linux/hidraw.h>
-#include "bpf/loader.h"
+#include <errno.h>
 #include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include "bpf/loader.h"
 #include "file_state.h"
 #include "bpf/common.h"
+#include "event_loop.h"
+#include "feature_report.h"
+#include "uevent.h"
+#include "device_session.h"
+#include "discovery.h"
+#include "discovery_cache.h"
+#include "device_profile.h"
+#include "startup_trace.h"
+#include "config.h"
+
+#define STATE_WRITE_DELAY_SEC 1 // coalesce state file writes from rapid toggles
+#define EVDEV_READ_BATCH 16 // input_events read per wakeup
+
+// the only keys evdev delivers to the daemon
+static const int fn_esc_keys[] = { KEY_PROG3, KEY_FN_ESC };
+
+typedef struct daemon_state daemon_state_t;
+
+// one keyboard the bpf program is attached to
+typedef struct {
+    daemon_state_t *daemon;
+    device_session_t session;
+    int hid_id;   // -1 for a free slot
+    int evdev_fd; // owned by the session, -1 when evdev isn't used or the device is gone
+} keyboard_t;
+
+struct daemon_state {
+    int profile; // the bpf program is built for one model, only keyboards with this profile are attached
+    int program_ready; // set once the program is loaded, only changed while the feature queue is idle
+    config_t config;
+    int debug_level; // from the command line, used when the config doesn't set one
+    int remaps[(MAX_PROFILE_REMAPS + MAX_CONFIG_REMAPS) * 2]; // the profile's remaps followed by the config's
+    int remap_count;
+    int fn_state;
+    int state_dirty; // fn_state hasn't been written to the state file yet
+    keyboard_t keyboards[MAX_DEVICES];
+    int use_evdev; // fn + esc is read from evdev rather than reported by bpf
+    int timer_fd;
+    unsigned long evdev_wakeups; // reads on the evdev fds
+    unsigned long evdev_events;  // input_events returned by those reads
+};
+
+/**
+ * Toggle the fn lock state by sending a HID feature report on the session's hidraw device
+ * @param session the keyboard's device session
+ * @param fn_lock 0 = fn lock on (f1-12 buttons act as hotkeys), 1 = fn lock off (f1-12 buttons act as normal)
+ * @return 0 on success, -1 on failure with errno set
+ */
+int toggle_fnlock(device_session_t *session, int fn_lock)
+{
+    const device_profile_t *profile = get_device_profile(session->info.profile);
+    unsigned char hid_buffer[FN_LOCK_REPORT_SIZE] = {};
+
+    if (profile == nullptr) {
+        errno = ENODEV;
+        return -1;
+    }
 
-#define VID_PID "0B05:19B6" // Asus ProArt Keyboard VID:PID
+    // the layout comes from the keyboard's profile, load_device_profiles checked it fits
+    const struct fn_lock_report_layout *layout = &profile->fn_lock_report;
+    hid_buffer[0] = layout->report_id;
+    hid_buffer[1] = layout->cmd;
+    hid_buffer[2] = layout->sub;
+    hid_buffer[layout->state_offset] = fn_lock; // Set fn lock byte
+
+    if (device_session_send_feature(session, hid_buffer, layout->size) < 0) {
+        perror("Error sending feature report");
+        return -1;
+    }
+    return 0;
+}
 
 /**
- * Find the first input device and hidraw device associated with a HID device
- * @param hid_path: The HID sysfs path (e.g., "/sys/bus/hid/devices/0003:0B05:19B6.0002")
- * @param devices: Structure to store found device paths
- * @return 0 on success, -1 on error
+ * Set the fn lock state through the bpf program, falling back to hidraw
+ * when no program is loaded in this process or the daemon.
+ * The daemon's attached keyboards go through the command ring buffer so the program's state follows.
+ * @param session: the keyboard's device session
+ * @param fn_lock: 0 = fn lock on, 1 = fn lock off
+ * @return 0 on success, -1 on failure with errno set
  */
-int find_hid_devices_paths(const char *hid_path, hid_sub_paths_t *devices) {
-    DIR *dir;
-    struct dirent *entry;
-    char path[MAX_PATH];
-    struct stat st;
-
-    // Initialize the structure
-    memset(devices, 0, sizeof(hid_sub_paths_t));
-
-    // Check if the HID path exists
-    if (stat(hid_path, &st) != 0) {
-        fprintf(stderr, "HID path does not exist: %s\n", hid_path);
+int set_fnlock(device_session_t *session, int fn_lock)
+{
+    int hid_id = device_session_hid_id(session);
+
+    if (hid_id >= 0 && (bpf_set_fn_lock(hid_id, fn_lock) == 0 || bpf_send_fn_lock(hid_id, fn_lock) == 0))
+    {
+        printf("Sent feature report through bpf\n");
+        return 0;
+    }
+    return toggle_fnlock(session, fn_lock);
+}
+
+/**
+ * feature_sender_t for the feature report queue, every keyboard gets the setting
+ * @param ctx: the MAX_DEVICES keyboard slots
+ */
+static int send_feature_setting(feature_setting_t setting, int value, void *ctx)
+{
+    keyboard_t *keyboards = ctx;
+    const daemon_state_t *daemon = keyboards[0].daemon;
+    int err = 0, saved_errno = 0;
+
+    // while the daemon's program is still loading on another thread the loader can't be used yet
+    int (*send)(device_session_t *session, int fn_lock) =
+        daemon != nullptr && !daemon->program_ready ? toggle_fnlock : set_fnlock;
+
+    if (setting != SETTING_FN_LOCK)
+    {
+        errno = EINVAL;
         return -1;
     }
 
-    // Find hidraw device
-    snprintf(path, sizeof(path), "%s/hidraw", hid_path);
-    dir = opendir(path);
-    if (dir) {
-        while ((entry = readdir(dir)) != NULL) {
-            if (strncmp(entry->d_name, "hidraw", 6) == 0) {
-                snprintf(devices->hidraw_device, MAX_PATH,
-                        "/dev/%s", entry->d_name);
-                break;
-            }
-        }
-        closedir(dir);
-    }
-
-    // Find first input device
-    snprintf(path, sizeof(path), "%s/input", hid_path);
-    dir = opendir(path);
-    if (dir) {
-        int found_input = 0;
-        while ((entry = readdir(dir)) != NULL && !found_input) {
-            // Look for input event devices (e.g., input5)
-            if (strncmp(entry->d_name, "input", 5) == 0 &&
-                strcmp(entry->d_name, "input") != 0) {
-
-                // Look for event devices within this input device
-                char event_path[MAX_PATH];
-                snprintf(event_path, sizeof(event_path),
-                        "%s/%s", path, entry->d_name);
-
-                DIR *event_dir = opendir(event_path);
-                if (event_dir) {
-                    struct dirent *event_entry;
-                    while ((event_entry = readdir(event_dir)) != NULL) {
-                        if (strncmp(event_entry->d_name, "event", 5) == 0) {
-                            snprintf(devices->input_device, MAX_PATH,
-                                    "/dev/input/%s", event_entry->d_name);
-                            found_input = 1;  // Stop after finding first
-                            break;
-                        }
-                    }
-                    closedir(event_dir);
-                }
-            }
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        // slots are filled and emptied by the main thread, the session knows whether it has a device
+        if (device_session_hid_id(&keyboards[i].session) < 0)
+            continue;
+        if (send(&keyboards[i].session, value))
+        {
+            err = -1;
+            saved_errno = errno;
         }
-        closedir(dir);
     }
+    errno = saved_errno;
+    return err;
+}
 
-    return 0;
+/**
+ * Set up empty keyboard slots
+ * @param keyboards: MAX_DEVICES slots
+ * @param daemon: the daemon state, nullptr outside of the daemon
+ */
+static void init_keyboards(keyboard_t *keyboards, daemon_state_t *daemon)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        keyboards[i].daemon = daemon;
+        keyboards[i].hid_id = -1;
+        keyboards[i].evdev_fd = -1;
+        device_session_init(&keyboards[i].session);
+    }
 }
 
 /**
- * Find a HID device by its VID:PID and verify its report descriptor matches the one we want
- * @param search_id "VID:PID" to search for, e.g. "0B05:19B6"
- * @param info the structure to fill with the found HID device information
- * @return 0 on success, -1 on failure
+ * Save the attached keyboards to the discovery cache for the restore oneshot
+ * @param keyboards: MAX_DEVICES slots, only touched from the main thread
+ */
+static void save_discovery_cache(keyboard_t *keyboards)
+{
+    hid_device_info_t infos[MAX_DEVICES];
+    hid_sub_paths_t paths[MAX_DEVICES];
+    int count = 0;
+
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        if (keyboards[i].hid_id < 0)
+            continue;
+        infos[count] = keyboards[i].session.info;
+        paths[count] = keyboards[i].session.paths;
+        count++;
+    }
+    if (write_discovery_cache(infos, paths, count))
+        printf("failed to write discovery cache\n");
+}
+
+/**
+ * Close every keyboard's device nodes, the slots can't be used afterwards
+ * @param keyboards: MAX_DEVICES slots
+ */
+static void close_keyboards(keyboard_t *keyboards)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+        device_session_close(&keyboards[i].session);
+}
+
+
+/**
+ * Milliseconds since a CLOCK_MONOTONIC timestamp
  */
-int find_hid_id(const char *search_id, hid_device_info_t *info) {
-    const char *hid_path = "/sys/bus/hid/devices";
-    DIR *dir;
-    struct dirent *entry;
-
-    dir = opendir(hid_path);
-    if (dir == NULL) {
-        perror("Failed to open /sys/bus/hid/devices");
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/**
+ * Time both discovery backends and the node lookup, run with the discovery subcommand
+ * @return 0 on success, -1 if no keyboard was found
+ */
+static int print_discovery_timing()
+{
+    struct {
+        const char *name;
+        int (*find)(hid_device_info_t *infos, int max);
+    } backends[] = {
+        { "sysfs", find_hid_ids_sysfs },
+        { "hidraw", find_hid_ids_hidraw },
+    };
+    hid_device_info_t infos[MAX_DEVICES];
+    hid_sub_paths_t paths;
+    struct timespec start;
+    int count = 0;
+
+    for (size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        count = backends[i].find(infos, MAX_DEVICES);
+        printf("%-8s %d device(s) in %.3f ms\n", backends[i].name, count, elapsed_ms(&start));
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        find_hid_devices_paths(infos[i].hid_path, &paths);
+        printf("nodes    hid %d in %.3f ms: %s %s (%s)\n", infos[i].hid_id, elapsed_ms(&start),
+            paths.hidraw_device, paths.input_device, get_device_profile(infos[i].profile)->name);
+    }
+    return count > 0 ? 0 : -1;
+}
+
+int restore(int state)
+{
+    // restore the default state
+    printf("restoring state oneshot\n");
+
+    hid_device_info_t infos[MAX_DEVICES];
+    hid_sub_paths_t paths[MAX_DEVICES];
+    keyboard_t keyboards[MAX_DEVICES];
+    struct timespec start;
+
+    // the daemon saved what it found, a full scan is only needed when that no longer matches
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int count = read_discovery_cache(infos, paths, MAX_DEVICES);
+    int cached = count > 0;
+    if (!cached)
+        count = find_hid_ids(infos, MAX_DEVICES);
+    if (count <= 0)
         return -1;
+    printf("discovery: %d keyboard(s) in %.3f ms%s\n", count, elapsed_ms(&start), cached ? " (cached)" : "");
+
+    init_keyboards(keyboards, nullptr);
+    for (int i = 0; i < count; i++)
+    {
+        if (device_session_adopt(&keyboards[i].session, &infos[i], cached ? &paths[i] : nullptr) == 0)
+            keyboards[i].hid_id = infos[i].hid_id;
     }
+    if (!cached)
+        save_discovery_cache(keyboards);
 
-    while ((entry = readdir(dir)) != NULL) {
-        // Skip . and .. directories
-        if (strcmp(entry->d_name, ".") == 0 ||
-            strcmp(entry->d_name, "..") == 0) {
-            continue;
-            }
+    // every setting is queued first so they go out as one batch
+    if (feature_queue_start(send_feature_setting, keyboards))
+    {
+        close_keyboards(keyboards);
+        return -1;
+    }
+    feature_queue_set(SETTING_FN_LOCK, state);
+    feature_queue_flush();
+    feature_queue_stop();
+    close_keyboards(keyboards);
+    printf("restored state: %d in %.3f ms\n", state, elapsed_ms(&start));
 
-        // Check if device name contains the search ID
-        if (strstr(entry->d_name, search_id) != NULL) {
-            // we found a matching device, need to check the report descriptor
-            // get the full path and add /report_descriptor
-            char full_path[MAX_PATH];
-            sprintf(full_path, "%s/%s/report_descriptor", hid_path, entry->d_name);
-            FILE *fp = fopen(full_path, "rb");
-            if (fp == NULL)
-            {
-                printf("cannot open device %s\n", full_path);
-                continue;
-            }
+    return 0;
+}
 
-            // read first 4kb of the report descriptor
-            unsigned char report_descriptor[4096];
-            size_t bytes_read = fread(report_descriptor, 1, sizeof(report_descriptor), fp);
-            fclose(fp);
-            if (bytes_read <= 0) {
-                printf("Failed to read report descriptor for device %s\n", entry->d_name);
-                continue;
-            }
+/**
+ * Arm the deferred state write, a burst of toggles only writes the state file once
+ * @param daemon: the daemon state
+ */
+static void schedule_state_write(daemon_state_t *daemon)
+{
+    struct itimerspec delay = {
+        .it_value = { .tv_sec = STATE_WRITE_DELAY_SEC },
+    };
 
-            // check against the expected report descriptor
-            unsigned char expected_descriptor[] = {0x06, 0x31, 0xff, 0x09, 0x76, 0xa1, 0x01, 0x85, 0x5a};
-            void *status = memmem(report_descriptor, bytes_read, expected_descriptor, sizeof(expected_descriptor));
-            if (status != NULL)
-            {
-                // extract the id (the number after the last period in the directory name)
-                char *colon_pos = strrchr(entry->d_name, '.');
-                if (colon_pos != NULL)
-                {
-                    info->hid_id = atoi(colon_pos + 1);
-                    sprintf(info->hid_path, "%s/%s", hid_path, entry->d_name);
-                    return 0;
-                }
-                return -1;
+    daemon->state_dirty = 1;
+    if (timerfd_settime(daemon->timer_fd, 0, &delay, nullptr) < 0)
+    {
+        perror("Failed to arm state timer");
+        if (write_state(daemon->fn_state) == 0)
+            daemon->state_dirty = 0;
+    }
+}
+
+/**
+ * Flip the fn lock state, send it to the keyboard and schedule saving it
+ * @param daemon: the daemon state
+ */
+static void handle_fn_esc(daemon_state_t *daemon)
+{
+    printf("Fn+Esc Key pressed! Sending HID report...\n");
+
+    // toggle the state
+    daemon->fn_state = !daemon->fn_state;
+
+    // sent by the feature report worker, rapid presses collapse into the latest state
+    feature_queue_set(SETTING_FN_LOCK, daemon->fn_state);
+    bpf_publish_fn_lock(-1, daemon->fn_state);
+    bpf_publish_counters();
+    printf("Fn lock toggled to %s\n", daemon->fn_state ? "off" : "on");
+
+    schedule_state_write(daemon);
+}
+
+static void on_evdev_readable(int fd, void *ctx)
+{
+    keyboard_t *keyboard = ctx;
+    daemon_state_t *daemon = keyboard->daemon;
+    struct input_event events[EVDEV_READ_BATCH];
+
+    ssize_t bytes = read(fd, events, sizeof(events));
+    if (bytes < 0 && errno == ENODEV) {
+        // unplugged, the remove uevent detaches everything else
+        printf("evdev device of hid %d gone, waiting for the keyboard to come back\n", keyboard->hid_id);
+        event_loop_remove(fd);
+        keyboard->evdev_fd = -1;
+        device_session_invalidate(&keyboard->session);
+        return;
+    }
+    if (bytes < (ssize_t)sizeof(events[0])) {
+        perror("Error reading event");
+        event_loop_stop(-1);
+        return;
+    }
+
+    daemon->evdev_wakeups++;
+    for (size_t i = 0; i < bytes / sizeof(events[0]); i++)
+    {
+        const struct input_event *ev = &events[i];
+        daemon->evdev_events++;
+
+        // Check if it's a key event for our target keycode
+        if (ev->type == EV_KEY && (ev->code == KEY_PROG3 || ev->code == KEY_FN_ESC)) {
+            if (ev->value == 1) {  // Key press (not release)
+                handle_fn_esc(daemon);
             }
         }
     }
-    printf("No suitable HID device found with VID:PID %s\n", search_id);
-    closedir(dir);
-    return -1;
+}
+
+static void on_bpf_key(int scancode, void *ctx)
+{
+    if (scancode == FN_ESC_SCANCODE)
+        handle_fn_esc(ctx);
+}
+
+static void on_bpf_fn_lock(int fn_lock, void *ctx)
+{
+    daemon_state_t *daemon = ctx;
+
+    // the keyboard already has the new state, it only needs to be saved.
+    // each keyboard toggles on its own, the last one toggled is what gets restored
+    daemon->fn_state = fn_lock;
+    schedule_state_write(daemon);
+}
+
+static void on_bpf_events_readable(int fd, void *ctx)
+{
+    if (bpf_consume_events())
+        event_loop_stop(-1);
+    // the status page's counters are refreshed whenever the daemon is awake anyway
+    bpf_publish_counters();
 }
 
 /**
- * Toggle the fn lock state by sending a HID feature report
- * @param hidraw_path path to specific hidraw device, e.g. /dev/hidraw1
- * @param fn_lock 0 = fn lock on (f1-12 buttons act as hotkeys), 1 = fn lock off (f1-12 buttons act as normal)
+ * Combine a profile's remaps with the config file's, the config's come last so they win
+ * @param daemon: the daemon state, its remaps are rebuilt from its config
+ * @param profile: the model the program is loaded for
+ */
+static void merge_remaps(daemon_state_t *daemon, const device_profile_t *profile)
+{
+    memcpy(daemon->remaps, profile->remaps, profile->remap_count * 2 * sizeof(int));
+    memcpy(daemon->remaps + profile->remap_count * 2, daemon->config.remaps,
+        daemon->config.remap_count * 2 * sizeof(int));
+    daemon->remap_count = profile->remap_count + daemon->config.remap_count;
+}
+
+/**
+ * Read the config file again, swap in the new remap table and apply the settings, the program isn't reloaded
+ * @param daemon: the daemon state, run_bpf must have succeeded
+ */
+static void reload_config(daemon_state_t *daemon)
+{
+    if (load_config(CONFIG_PATH, &daemon->config))
+    {
+        printf("Keeping the previous config\n");
+        return;
+    }
+    merge_remaps(daemon, get_device_profile(daemon->profile));
+    int err = bpf_update_remaps(daemon->remaps, daemon->remap_count);
+
+    // settings changes are queued and applied together with one syscall
+    int debug_level = daemon->config.debug_level >= 0 ? daemon->config.debug_level : daemon->debug_level;
+    if (bpf_queue_command(CMD_SET_DEBUG_LEVEL, debug_level) || bpf_apply_commands())
+        err = -1;
+    if (err == 0)
+        printf("Reloaded %s\n", CONFIG_PATH);
+}
+
+static void on_signal(int fd, void *ctx)
+{
+    struct signalfd_siginfo info;
+
+    if (read(fd, &info, sizeof(info)) != sizeof(info))
+        return;
+    if (info.ssi_signo == SIGHUP)
+    {
+        reload_config(ctx);
+        return;
+    }
+    printf("Received signal %d, exiting\n", info.ssi_signo);
+    event_loop_stop(0);
+}
+
+static void on_config_changed(int fd, void *ctx)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int changed = 0;
+    ssize_t len;
+
+    // editors replace the file as often as they write it, both count
+    while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char *p = buffer; p < buffer + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)p;
+            if (event->len && strcmp(event->name, CONFIG_NAME) == 0)
+                changed = 1;
+        }
+    }
+    if (changed)
+        reload_config(ctx);
+}
+
+static void on_state_timer(int fd, void *ctx)
+{
+    daemon_state_t *daemon = ctx;
+    uint64_t expirations;
+
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        return;
+
+    if (daemon->state_dirty)
+    {
+        if (write_state(daemon->fn_state))
+            printf("failed to write state file\n");
+        daemon->state_dirty = 0;
+    }
+}
+
+/**
+ * Open a keyboard's evdev node and set its event mask, the caller adds it to the event loop
+ * @param keyboard: the keyboard
  * @return 0 on success, -1 on failure
  */
-int toggle_fnlock(const char *hidraw_path, int fn_lock)
+static int open_evdev(keyboard_t *keyboard)
 {
-    unsigned char hid_buffer[63] = {
-        0x5a, 0xd0, 0x4e, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
-    };
+    keyboard->evdev_fd = device_session_evdev_fd(&keyboard->session);
+    if (keyboard->evdev_fd < 0)
+        return -1;
+    device_session_mask_evdev(keyboard->evdev_fd, fn_esc_keys, sizeof(fn_esc_keys) / sizeof(fn_esc_keys[0]));
+    return 0;
+}
 
-    // Open the hidraw device for writing
-    int hidraw_fd = open(hidraw_path, O_RDWR);
-    if (hidraw_fd < 0) {
-        perror("Failed to open hidraw device");
-        // close(evdev_fd);
+/**
+ * Find the keyboard slot of a device
+ * @param hid_id: the HID device ID to look for, -1 finds a free slot
+ * @return the slot, nullptr if there's none
+ */
+static keyboard_t *find_keyboard(daemon_state_t *daemon, int hid_id)
+{
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        if (daemon->keyboards[i].hid_id == hid_id)
+            return &daemon->keyboards[i];
+    }
+    return nullptr;
+}
+
+/**
+ * Give a keyboard's device to its slot without attaching yet, the nodes can be used right away
+ * @param daemon: the daemon state
+ * @param keyboard: an empty slot
+ * @param info: the matched HID device
+ * @param paths: the device's nodes if already resolved, nullptr to find them
+ * @return 0 on success, -1 if the keyboard isn't the daemon's model or its nodes weren't found
+ */
+static int adopt_keyboard(daemon_state_t *daemon, keyboard_t *keyboard, const hid_device_info_t *info,
+    const hid_sub_paths_t *paths)
+{
+    if (info->profile != daemon->profile)
+    {
+        printf("Not attaching to hid %d, it's a %s and the program was loaded for a %s\n", info->hid_id,
+            get_device_profile(info->profile)->name, get_device_profile(daemon->profile)->name);
         return -1;
     }
+    if (device_session_adopt(&keyboard->session, info, paths))
+    {
+        printf("Failed to find device paths of hid %d\n", info->hid_id);
+        return -1;
+    }
+    return 0;
+}
 
-    hid_buffer[3] = fn_lock; // Set fn lock byte
+/**
+ * Attach the shared bpf program to an adopted keyboard, the slot is freed if that fails
+ * @param daemon: the daemon state, run_bpf must have succeeded
+ * @param keyboard: a slot filled by adopt_keyboard
+ * @return 0 on success, -1 on failure
+ */
+static int attach_keyboard(daemon_state_t *daemon, keyboard_t *keyboard)
+{
+    const int hid_id = device_session_hid_id(&keyboard->session);
 
-    int res = ioctl(hidraw_fd, HIDIOCSFEATURE(sizeof(hid_buffer)), hid_buffer);
-    if (res < 0) {
-        perror("Error sending feature report");
+    if (bpf_attach_device(hid_id, daemon->fn_state))
+    {
+        printf("Failed to attach to hid %d\n", hid_id);
+        device_session_release(&keyboard->session);
         return -1;
-    } else {
-        printf("Sent feature report (%d bytes)\n", res);
     }
+    keyboard->hid_id = hid_id;
+
+    printf("HID Device ID: %d\n", hid_id);
+    printf("HID Device Path: %s\n", keyboard->session.info.hid_path);
+    printf("Input path: %s\n", keyboard->session.paths.input_device);
+    printf("Hidraw path: %s\n", keyboard->session.paths.hidraw_device);
     return 0;
 }
 
-
-int restore(int state)
+/**
+ * Give a keyboard a free slot and attach the shared bpf program to it
+ * @param daemon: the daemon state, run_bpf must have succeeded
+ * @param info: the matched HID device
+ * @return the keyboard's slot, nullptr on failure
+ */
+static keyboard_t *add_keyboard(daemon_state_t *daemon, const hid_device_info_t *info)
 {
-    // restore the default state
-    printf("restoring state oneshot\n");
+    keyboard_t *keyboard = find_keyboard(daemon, -1);
+
+    if (keyboard == nullptr)
+    {
+        printf("No free slot for hid %d\n", info->hid_id);
+        return nullptr;
+    }
+    if (adopt_keyboard(daemon, keyboard, info, nullptr) || attach_keyboard(daemon, keyboard))
+        return nullptr;
+    return keyboard;
+}
 
+/*
+ * run_bpf on its own thread so verification overlaps discovery and the initial fn lock report,
+ * nothing else touches the loader until bpf_load_join
+ */
+typedef struct {
+    pthread_t thread;
+    const bpf_options_t *options;
+    int threaded;
     int err;
-    hid_device_info_t device_info;
-    hid_sub_paths_t devices;
+} bpf_load_t;
 
-    err = find_hid_id(VID_PID, &device_info);
-    if (err)
+static void *bpf_load_thread(void *arg)
+{
+    bpf_load_t *load = arg;
+
+    trace_startup_mark();
+    load->err = run_bpf(load->options);
+    return nullptr;
+}
+
+/**
+ * Start loading the bpf program, it's loaded right away if no thread can be started
+ * @param load: tracks the load until bpf_load_join
+ * @param options: the run_bpf options, must not change until bpf_load_join
+ * @param serial: load right away instead, to compare against the overlapped startup
+ */
+static void bpf_load_start(bpf_load_t *load, const bpf_options_t *options, int serial)
+{
+    load->options = options;
+    load->threaded = !serial && pthread_create(&load->thread, nullptr, bpf_load_thread, load) == 0;
+    if (!load->threaded)
+        load->err = run_bpf(options);
+}
+
+/**
+ * Wait for the load started by bpf_load_start
+ * @return the run_bpf result
+ */
+static int bpf_load_join(bpf_load_t *load)
+{
+    if (load->threaded)
+        pthread_join(load->thread, nullptr);
+    load->threaded = 0;
+    return load->err;
+}
+
+/**
+ * Point the bpf options at a device profile's report layout, and its remaps combined with the config's
+ */
+static void set_profile_options(bpf_options_t *options, daemon_state_t *daemon, const device_profile_t *profile)
+{
+    options->hotkey_report_id = profile->report_id;
+    options->fn_lock_report = profile->fn_lock_report;
+
+    merge_remaps(daemon, profile);
+    options->remap_array = daemon->remaps;
+    options->remap_count = daemon->remap_count;
+}
+
+/**
+ * Drop everything tied to a keyboard after it was unplugged or unbound and free its slot
+ * @param keyboard: the keyboard
+ */
+static void remove_keyboard(keyboard_t *keyboard)
+{
+    printf("keyboard hid %d gone, detaching\n", keyboard->hid_id);
+    bpf_detach_device(keyboard->hid_id);
+    if (keyboard->evdev_fd >= 0)
+        event_loop_remove(keyboard->evdev_fd);
+    keyboard->evdev_fd = -1;
+    device_session_release(&keyboard->session);
+    keyboard->hid_id = -1;
+    save_discovery_cache(keyboard->daemon->keyboards);
+}
+
+/**
+ * Attach to a keyboard that was just bound to its driver and bring it to the saved state.
+ * Only the new device is examined and the already verified bpf program is reused.
+ * @param daemon: the daemon state
+ * @param devpath: the HID device's sysfs path from the uevent, without /sys
+ */
+static void device_bound(daemon_state_t *daemon, const char *devpath)
+{
+    struct timespec start;
+    hid_device_info_t info;
+    keyboard_t *keyboard;
+    char hid_path[MAX_PATH];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    snprintf(hid_path, sizeof(hid_path), "/sys%s", devpath);
+    if (match_hid_device(hid_path, &info))
+        return; // one of the keyboard's other interfaces
+
+    if (find_keyboard(daemon, info.hid_id) != nullptr)
+        return;
+    keyboard = add_keyboard(daemon, &info);
+    if (keyboard == nullptr)
+        return;
+
+    if (daemon->use_evdev && (open_evdev(keyboard) || event_loop_add(keyboard->evdev_fd, on_evdev_readable, keyboard)))
+        printf("Failed to watch evdev of hid %d\n", info.hid_id);
+    save_discovery_cache(daemon->keyboards);
+
+    // the keyboard powers up in its default mode, the others already have this state
+    feature_queue_set(SETTING_FN_LOCK, daemon->fn_state);
+    feature_queue_flush();
+
+    printf("attached to hid %d, ready in %.1f ms\n", info.hid_id, elapsed_ms(&start));
+}
+
+static void on_uevent(int fd, void *ctx)
+{
+    daemon_state_t *daemon = ctx;
+    char buffer[UEVENT_BUFFER_SIZE];
+    uevent_t event;
+    int hid_events = 0;
+
+    // drain everything queued, the socket is non-blocking
+    while (read_uevent(fd, buffer, sizeof(buffer), &event) == 0)
     {
-        printf("Failed to find hid\n");
-        return -1;
+        if (strcmp(event.subsystem, "hid") != 0)
+            continue;
+        hid_events++;
+
+        // the hidraw and input nodes exist once the driver is bound, "add" is too early.
+        // devices without a profile are dropped by their ids before anything is read
+        if (strcmp(event.action, "bind") == 0)
+        {
+            device_bound(daemon, event.devpath);
+        }
+        else if (strcmp(event.action, "remove") == 0 || strcmp(event.action, "unbind") == 0)
+        {
+            const char *id = strrchr(event.devpath, '.');
+            keyboard_t *keyboard = id != NULL ? find_keyboard(daemon, strtol(id + 1, NULL, 16)) : nullptr;
+            if (keyboard != nullptr)
+                remove_keyboard(keyboard);
+        }
     }
+    // a keyboard that went away takes its last reports' counts with it otherwise
+    if (hid_events)
+        bpf_publish_counters();
+}
 
-    err = find_hid_devices_paths(device_info.hid_path, &devices);
-    if (err) {
-        fprintf(stderr, "Failed to find HID devices\n");
+/**
+ * Wait on every event source from a single thread until a signal or an error stops the loop.
+ * Nothing is polled periodically, the process only wakes when one of the fds is readable.
+ * @param daemon: the daemon state, run_bpf must have succeeded, evdev fds are only watched if open
+ * @return 0 on a clean shutdown, -1 on error
+ */
+static int run_event_loop(daemon_state_t *daemon)
+{
+    sigset_t signals;
+    int signal_fd, uevent_fd, config_fd, err = -1;
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) < 0)
+    {
+        perror("Failed to block signals");
         return -1;
     }
 
-    toggle_fnlock(devices.hidraw_device, state);
-    printf("restored state: %d\n", state);
+    signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    daemon->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    uevent_fd = open_uevent_socket();
+    config_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (signal_fd < 0 || daemon->timer_fd < 0 || uevent_fd < 0 || config_fd < 0)
+    {
+        perror("Failed to create event loop fds");
+        goto out;
+    }
+    // the directory is watched since the file can be created or replaced
+    if (inotify_add_watch(config_fd, CONFIG_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        printf("Not watching %s, reload the config with SIGHUP\n", CONFIG_DIR);
+        close(config_fd);
+        config_fd = -1;
+    }
 
-    return 0;
+    if (event_loop_init())
+        goto out;
+
+    for (int i = 0; i < MAX_DEVICES; i++)
+    {
+        keyboard_t *keyboard = &daemon->keyboards[i];
+        if (keyboard->evdev_fd >= 0 && event_loop_add(keyboard->evdev_fd, on_evdev_readable, keyboard))
+        {
+            event_loop_destroy();
+            goto out;
+        }
+    }
+
+    if (event_loop_add(bpf_events_fd(), on_bpf_events_readable, daemon) ||
+        event_loop_add(signal_fd, on_signal, daemon) ||
+        event_loop_add(daemon->timer_fd, on_state_timer, daemon) ||
+        event_loop_add(uevent_fd, on_uevent, daemon) ||
+        (config_fd >= 0 && event_loop_add(config_fd, on_config_changed, daemon)))
+    {
+        event_loop_destroy();
+        goto out;
+    }
+
+    err = event_loop_run();
+    event_loop_destroy();
+
+out:
+    if (signal_fd >= 0)
+        close(signal_fd);
+    if (daemon->timer_fd >= 0)
+        close(daemon->timer_fd);
+    if (uevent_fd >= 0)
+        close(uevent_fd);
+    if (config_fd >= 0)
+        close(config_fd);
+    daemon->timer_fd = -1;
+    return err;
 }
 
 int main(int argc, char **argv)
 {
+    // checked before anything else so read_state is part of the trace
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--trace-startup") == 0)
+            trace_startup_enable(TRACE_FORMAT_LINE);
+        else if (strcmp(argv[i], "--trace-startup=json") == 0)
+            trace_startup_enable(TRACE_FORMAT_JSON);
+    }
+
+    if (argc > 1 && strcmp(argv[1], "stats") == 0) {
+        return print_bpf_stats();
+    }
+    if (argc > 1 && strcmp(argv[1], "status") == 0) {
+        return print_bpf_status(argc > 2 && strcmp(argv[2], "--watch") == 0);
+    }
+    if (argc > 1 && strcmp(argv[1], "unpin") == 0) {
+        return bpf_unpin_all();
+    }
+
+    // extra models on top of the built in profiles, a missing file is fine
+    if (load_device_profiles(DEVICE_PROFILES_PATH))
+        return -1;
+    trace_startup_phase("profiles");
+    if (argc > 1 && strcmp(argv[1], "discovery") == 0) {
+        return print_discovery_timing();
+    }
+
     int fn_state = read_state();
     if (fn_state < 0)
     {
         printf("Failed to read state file\n");
         return -1;
     }
+    trace_startup_phase("read_state");
 
     if (argc > 1 && strcmp(argv[1], "restore") == 0) {
         return restore(fn_state);
     }
 
-    hid_device_info_t device_info;
-    hid_sub_paths_t devices;
-    int err, evdev_fd;
-    struct hid_modify_bpf *skel = nullptr;
-    struct input_event ev;
-
-    err = find_hid_id(VID_PID, &device_info);
-    if (err)
+    bpf_options_t bpf_options = {
+        .static_remaps = 0,
+        .debug_level = DEBUG_LEVEL_NONE,
+    };
+    int ringbuf_toggle = 0, kernel_toggle = 0, serial_startup = 0;
+    for (int i = 1; i < argc; i++)
     {
-        printf("Failed to find hid\n");
-        return -1;
+        if (strcmp(argv[i], "--static-remaps") == 0)
+            bpf_options.static_remaps = 1;
+        else if (strcmp(argv[i], "--debug") == 0)
+            bpf_options.debug_level = DEBUG_LEVEL_EVENTS;
+        else if (strcmp(argv[i], "--ringbuf-toggle") == 0)
+            ringbuf_toggle = 1;
+        else if (strcmp(argv[i], "--kernel-toggle") == 0)
+            kernel_toggle = 1;
+        else if (strcmp(argv[i], "--serial-startup") == 0)
+            serial_startup = 1;
     }
 
-    err = find_hid_devices_paths(device_info.hid_path, &devices);
-    if (err) {
-        fprintf(stderr, "Failed to find HID devices\n");
+    daemon_state_t daemon = {
+        .fn_state = fn_state,
+        .use_evdev = !ringbuf_toggle && !kernel_toggle,
+        .timer_fd = -1,
+    };
+    hid_device_info_t infos[MAX_DEVICES];
+    hid_sub_paths_t paths[MAX_DEVICES];
+    bpf_load_t load = {};
+    struct timespec start;
+    int err, count;
+
+    // remaps on top of the device profile's, reloaded on SIGHUP or when the file changes
+    if (load_config(CONFIG_PATH, &daemon.config))
         return -1;
-    }
+    daemon.debug_level = bpf_options.debug_level;
+    if (daemon.config.debug_level >= 0)
+        bpf_options.debug_level = daemon.config.debug_level;
 
-    printf("HID Device ID: %d\n", device_info.hid_id);
-    printf("HID Device Path: %s\n", device_info.hid_path);
-    printf("Input path: %s\n", devices.input_device);
-    printf("Hidraw path: %s\n", devices.hidraw_device);
+    // in ringbuf toggle mode the bpf program reports fn + esc directly and evdev isn't used
+    const int toggle_codes[] = { FN_ESC_SCANCODE };
+    if (kernel_toggle)
+    {
+        // the bpf program sends the report itself, the daemon only persists the result
+        bpf_options.kernel_toggle = 1;
+        bpf_options.fn_lock_handler = on_bpf_fn_lock;
+        bpf_options.fn_lock_handler_ctx = &daemon;
+    }
+    else if (ringbuf_toggle)
+    {
+        bpf_options.interesting_codes = toggle_codes;
+        bpf_options.interesting_count = 1;
+        bpf_options.key_handler = on_bpf_key;
+        bpf_options.key_handler_ctx = &daemon;
+    }
 
     /*
-     * this is a simple 1d array, add maps as pairs of: original scancode, new scancode
-     * 1. use hid-recorder to find the original scancode from the keyboard
-     * 2. read the hid-asus.c file to see what scancodes are recognized by the driver
-     * 3. remap the original scancode to one that is detected by the driver but isn't used for anything on yours
-     * 4. you can now use that keycode and bind functions using keyd or any other tool
+     * the program is built for one model before the keyboard is found, the last run's model is
+     * a good guess. One object is loaded and shared, each keyboard only gets its own struct_ops link.
      */
-    const int remaps[] = {
-        0x4e, 0x5c, // fn-lock (fn + esc) -> key_prog3
-        0x7e, 0xba, // emoji picker key -> key_prog2
-        0x8b, 0x38, // proart hub key -> key_prog1
-    };
-    err = run_bpf(skel, device_info.hid_id, &remaps[0], 3);
+    int loaded_profile = cached_device_profile();
+    if (loaded_profile < 0)
+        loaded_profile = 0;
+    set_profile_options(&bpf_options, &daemon, get_device_profile(loaded_profile));
+    bpf_load_start(&load, &bpf_options, serial_startup);
+    init_keyboards(daemon.keyboards, &daemon);
+
+    // discovery happens once, the sessions keep the device nodes open from here on
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    count = find_hid_ids(infos, MAX_DEVICES);
+    if (count > 0)
+        printf("discovery: %d keyboard(s) in %.3f ms\n", count, elapsed_ms(&start));
+    trace_startup_phase("discovery");
+
+    // the first keyboard found decides the model the program is attached for
+    daemon.profile = count > 0 ? infos[0].profile : loaded_profile;
+    for (int i = 0; i < count; i++)
+    {
+        const hid_sub_paths_t *found = find_hid_devices_paths(infos[i].hid_path, &paths[i]) ? nullptr : &paths[i];
+        adopt_keyboard(&daemon, &daemon.keyboards[i], &infos[i], found);
+    }
+    trace_startup_phase("paths");
+
+    // the restore doesn't need the program, it goes out over hidraw while the verifier runs
+    int queue_err = count > 0 ? feature_queue_start(send_feature_setting, daemon.keyboards) : -1;
+    if (!queue_err)
+    {
+        feature_queue_set(SETTING_FN_LOCK, daemon.fn_state);
+        feature_queue_flush();
+    }
+    trace_startup_phase("initial_report");
+
+    // attaching is the only step that needs both the devices and the program
+    err = bpf_load_join(&load);
+    daemon.program_ready = 1;
+    trace_startup_phase("bpf_wait");
+    if (queue_err)
+    {
+        if (!err)
+            cleanup_bpf();
+        close_keyboards(daemon.keyboards);
+        return -1;
+    }
+
+    const device_profile_t *profile = get_device_profile(daemon.profile);
+    printf("Device profile: %s\n", profile->name);
+    if (!err && loaded_profile != daemon.profile)
+    {
+        printf("Program was loaded for a %s, reloading\n", get_device_profile(loaded_profile)->name);
+        cleanup_bpf();
+        set_profile_options(&bpf_options, &daemon, profile);
+        err = run_bpf(&bpf_options);
+    }
     if (err)
     {
         printf("Failed to load BPF\n");
+        feature_queue_stop();
+        close_keyboards(daemon.keyboards);
         return -1;
     }
 
-    evdev_fd = open(devices.input_device, O_RDONLY);
-    if (evdev_fd < 0) {
-        perror("Failed to open evdev device");
-        printf("Try running as root or check device path\n");
+    int attached = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (device_session_hid_id(&daemon.keyboards[i].session) >= 0 && attach_keyboard(&daemon, &daemon.keyboards[i]) == 0)
+            attached++;
+    }
+    if (attached == 0)
+    {
+        printf("Failed to attach to any keyboard\n");
+        feature_queue_stop();
+        cleanup_bpf();
+        close_keyboards(daemon.keyboards);
         return -1;
     }
+    // every keyboard got the restored state, clients polling the status map see it from here on
+    bpf_publish_fn_lock(-1, daemon.fn_state);
+    bpf_publish_counters();
+    trace_startup_phase("attach");
 
-    // set the default state before entering the loop
-    toggle_fnlock(devices.hidraw_device, fn_state);
-
-    while (1) {
-        // Read input event
-        ssize_t bytes = read(evdev_fd, &ev, sizeof(ev));
-
-        if (bytes < (ssize_t)sizeof(ev)) {
-            perror("Error reading event");
+    for (int i = 0; i < MAX_DEVICES && daemon.use_evdev; i++)
+    {
+        if (daemon.keyboards[i].hid_id >= 0 && open_evdev(&daemon.keyboards[i]))
+        {
+            printf("Try running as root or check device path\n");
+            feature_queue_stop();
+            cleanup_bpf();
+            close_keyboards(daemon.keyboards);
             return -1;
         }
-
-        // Check if it's a key event for our target keycode
-        if (ev.type == EV_KEY && (ev.code == KEY_PROG3 || ev.code == KEY_FN_ESC)) {
-            if (ev.value == 1) {  // Key press (not release)
-                printf("Fn+Esc Key pressed! Sending HID report...\n");
-
-                // toggle the state
-                fn_state = !fn_state;
-
-                err = toggle_fnlock(devices.hidraw_device, fn_state);
-                if (err) {
-                    printf("Failed to toggle fn lock\n");
-                } else {
-                    printf("Fn lock toggled to %s\n", fn_state ? "off" : "on");
-                }
-
-                err = write_state(fn_state);
-                if (err)
-                {
-                    printf("failed to write state file\n");
-                }
-            }
-        }
     }
+    trace_startup_phase("evdev");
+    save_discovery_cache(daemon.keyboards);
+    trace_startup_emit();
+
+    err = run_event_loop(&daemon);
+    feature_queue_stop();
+    printf("evdev wakeups: %lu, events read: %lu\n", daemon.evdev_wakeups, daemon.evdev_events);
+
+    // don't lose a toggle that happened right before shutdown
+    if (daemon.state_dirty)
+        write_state(daemon.fn_state);
+
+    cleanup_bpf();
+    close_keyboards(daemon.keyboards);
+    return err;
 }
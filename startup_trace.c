@@ -0,0 +1,124 @@
+#include "startup_trace.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#define MAX_TRACE_FIELDS 32
+
+static struct {
+    const char *name;
+    double value;
+    int is_phase; // value is a duration in ms
+} fields[MAX_TRACE_FIELDS];
+static int field_count = 0;
+static int trace_format = 0;
+static struct timespec trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+// phases of different threads overlap, so each thread measures from its own previous phase
+static __thread struct timespec last_mark;
+
+/**
+ * Milliseconds between two CLOCK_MONOTONIC timestamps
+ */
+static double diff_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e3 + (to->tv_nsec - from->tv_nsec) / 1e6;
+}
+
+/**
+ * Start tracing, the first phase is measured from here
+ * @param format: TRACE_FORMAT_LINE or TRACE_FORMAT_JSON
+ */
+void trace_startup_enable(int format)
+{
+    trace_format = format;
+    clock_gettime(CLOCK_MONOTONIC, &trace_start);
+    last_mark = trace_start;
+}
+
+/**
+ * Start the calling thread's next phase now, e.g. at the top of a thread started after tracing was enabled
+ */
+void trace_startup_mark()
+{
+    if (trace_format)
+        clock_gettime(CLOCK_MONOTONIC, &last_mark);
+}
+
+/**
+ * @return 1 if --trace-startup was given, 0 otherwise
+ */
+int trace_startup_enabled()
+{
+    return trace_format != 0;
+}
+
+/**
+ * End a phase, its duration is the time since the calling thread's previous phase ended. Does nothing unless tracing.
+ * @param name: the phase, must outlive the trace (a string literal)
+ */
+void trace_startup_phase(const char *name)
+{
+    struct timespec now;
+
+    if (!trace_format)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&trace_lock);
+    if (field_count < MAX_TRACE_FIELDS)
+    {
+        fields[field_count].name = name;
+        fields[field_count].value = diff_ms(&last_mark, &now);
+        fields[field_count].is_phase = 1;
+        field_count++;
+    }
+    pthread_mutex_unlock(&trace_lock);
+    last_mark = now;
+}
+
+/**
+ * Record a number that isn't a duration, e.g. verifier stats. Does nothing unless tracing.
+ * @param name: the field, must outlive the trace (a string literal)
+ */
+void trace_startup_value(const char *name, long long value)
+{
+    if (!trace_format)
+        return;
+    pthread_mutex_lock(&trace_lock);
+    if (field_count < MAX_TRACE_FIELDS)
+    {
+        fields[field_count].name = name;
+        fields[field_count].value = value;
+        fields[field_count].is_phase = 0;
+        field_count++;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Print everything recorded as one line, phases get an _ms suffix and the total is added last
+ */
+void trace_startup_emit()
+{
+    struct timespec now;
+    const int json = trace_format == TRACE_FORMAT_JSON;
+
+    if (!trace_format)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    pthread_mutex_lock(&trace_lock);
+    printf(json ? "{" : "startup:");
+    for (int i = 0; i < field_count; i++)
+    {
+        const char *suffix = fields[i].is_phase ? "_ms" : "";
+        const int decimals = fields[i].is_phase ? 3 : 0;
+        if (json)
+            printf("\"%s%s\":%.*f,", fields[i].name, suffix, decimals, fields[i].value);
+        else
+            printf(" %s%s=%.*f", fields[i].name, suffix, decimals, fields[i].value);
+    }
+    printf(json ? "\"total_ms\":%.3f}\n" : " total_ms=%.3f\n", diff_ms(&trace_start, &now));
+    fflush(stdout);
+    pthread_mutex_unlock(&trace_lock);
+}
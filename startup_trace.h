@@ -0,0 +1,14 @@
+#ifndef HIDTEST3_STARTUP_TRACE_H
+#define HIDTEST3_STARTUP_TRACE_H
+
+#define TRACE_FORMAT_LINE 1
+#define TRACE_FORMAT_JSON 2
+
+void trace_startup_enable(int format);
+int trace_startup_enabled();
+void trace_startup_mark();
+void trace_startup_phase(const char *name);
+void trace_startup_value(const char *name, long long value);
+void trace_startup_emit();
+
+#endif //HIDTEST3_STARTUP_TRACE_H
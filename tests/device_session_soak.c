@@ -0,0 +1,122 @@
+// Soak test for device_session: the fd count has to stay flat over a million feature reports and
+// over repeated disconnects, and the feature report path must never close the evdev fd.
+// Runs without hardware, the hidraw and evdev nodes are plain files, so every ioctl fails with ENOTTY.
+// usage: make test
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../device_session.h"
+
+#define SOAK_REPORTS 1000000
+#define SOAK_DISCONNECTS 100000
+
+/**
+ * Count this process's open fds, the directory's own fd is included every time
+ */
+static int count_fds()
+{
+    DIR *d = opendir("/proc/self/fd");
+    struct dirent *entry;
+    int count = 0;
+
+    if (d == nullptr)
+    {
+        perror("Failed to open /proc/self/fd");
+        exit(1);
+    }
+    while ((entry = readdir(d)) != nullptr)
+    {
+        if (entry->d_name[0] != '.')
+            count++;
+    }
+    closedir(d);
+    return count;
+}
+
+/**
+ * Create an empty file standing in for a device node
+ */
+static void make_node(char *path, size_t size, const char *dir, const char *name)
+{
+    snprintf(path, size, "%s/%s", dir, name);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        perror("Failed to create node");
+        exit(1);
+    }
+    close(fd);
+}
+
+static int check(int ok, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", ok ? "ok  " : "FAIL", what);
+    return ok ? 0 : 1;
+}
+
+int main()
+{
+    char dir[] = "/tmp/pxfnlock-soak.XXXXXX";
+    unsigned char report[FN_LOCK_REPORT_SIZE] = { FN_LOCK_REPORT_ID, FN_LOCK_REPORT_CMD, FN_LOCK_REPORT_SUB };
+    hid_device_info_t info = { .hid_id = 1 };
+    hid_sub_paths_t paths = {};
+    device_session_t session;
+    int failed = 0;
+
+    if (mkdtemp(dir) == nullptr)
+    {
+        perror("Failed to create temp dir");
+        return 1;
+    }
+    make_node(paths.hidraw_device, sizeof(paths.hidraw_device), dir, "hidraw");
+    make_node(paths.input_device, sizeof(paths.input_device), dir, "event");
+    // ids no profile matches, so rediscovery after a disconnect fails like it does while unplugged
+    snprintf(info.hid_path, sizeof(info.hid_path), "%s/0003:0000:0000.0001", dir);
+
+    // the session logs every disconnect, only the results go to stderr
+    if (freopen("/dev/null", "w", stdout) == nullptr)
+        return 1;
+
+    device_session_init(&session);
+    device_session_adopt(&session, &info, &paths);
+    int evdev_fd = device_session_evdev_fd(&session);
+    failed |= check(evdev_fd >= 0, "evdev node opened");
+
+    // the first report opens hidraw, every later one reuses it
+    device_session_send_feature(&session, report, sizeof(report));
+    const int baseline = count_fds();
+    for (int i = 0; i < SOAK_REPORTS; i++)
+        device_session_send_feature(&session, report, sizeof(report));
+    failed |= check(count_fds() == baseline, "fd count flat over a million feature reports");
+
+    // the worker sees the hidraw node go away, the evdev fd belongs to the main thread's event loop
+    close(session.hidraw_fd);
+    device_session_send_feature(&session, report, sizeof(report));
+    failed |= check(session.evdev_fd == evdev_fd && fcntl(evdev_fd, F_GETFD) >= 0,
+        "feature report failure leaves the evdev fd open");
+    failed |= check(session.hidraw_fd < 0, "feature report failure closes hidraw");
+
+    // unplug and replug: the worker drops hidraw, the main thread drops evdev and adopts the device again
+    for (int i = 0; i < SOAK_DISCONNECTS; i++)
+    {
+        device_session_send_feature(&session, report, sizeof(report));
+        if (session.hidraw_fd >= 0)
+            close(session.hidraw_fd);
+        device_session_send_feature(&session, report, sizeof(report));
+        device_session_invalidate(&session);
+        device_session_adopt(&session, &info, &paths);
+        device_session_evdev_fd(&session);
+    }
+    device_session_send_feature(&session, report, sizeof(report));
+    failed |= check(count_fds() == baseline, "fd count flat over repeated disconnects");
+
+    device_session_close(&session);
+    unlink(paths.hidraw_device);
+    unlink(paths.input_device);
+    rmdir(dir);
+    return failed;
+}
@@ -0,0 +1,130 @@
+// Wakeups of an evdev reader while a uhid virtual keyboard types, once with every event delivered and once with
+// the daemon's EVIOCSMASK, which should leave nothing but the Fn+Esc keys to wake it.
+// Needs root and uhid, no keyboard.
+// usage: sudo make bench-evdev
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include "../device_session.h"
+#include "uhid_device.h"
+
+#define KEYSTROKES 1000
+#define EVDEV_READ_BATCH 16 // same as the daemon
+#define BOOT_KEY_A 0x04     // HID usage of the A key
+
+// the keys the daemon leaves unmasked
+static const int fn_esc_keys[] = { KEY_PROG3, KEY_FN_ESC };
+
+// a boot protocol keyboard: modifiers, reserved byte and six key slots, without a report id
+static const unsigned char report_descriptor[] = {
+    0x05, 0x01, // Usage Page (Generic Desktop)
+    0x09, 0x06, // Usage (Keyboard)
+    0xa1, 0x01, // Collection (Application)
+    0x05, 0x07, //   Usage Page (Keyboard)
+    0x19, 0xe0, //   Usage Minimum (Left Control)
+    0x29, 0xe7, //   Usage Maximum (Right GUI)
+    0x15, 0x00, //   Logical Minimum (0)
+    0x25, 0x01, //   Logical Maximum (1)
+    0x75, 0x01, //   Report Size (1)
+    0x95, 0x08, //   Report Count (8)
+    0x81, 0x02, //   Input (Data, Variable, Absolute)
+    0x75, 0x08, //   Report Size (8)
+    0x95, 0x01, //   Report Count (1)
+    0x81, 0x01, //   Input (Constant)
+    0x19, 0x00, //   Usage Minimum (0)
+    0x29, 0x65, //   Usage Maximum (101)
+    0x15, 0x00, //   Logical Minimum (0)
+    0x25, 0x65, //   Logical Maximum (101)
+    0x75, 0x08, //   Report Size (8)
+    0x95, 0x06, //   Report Count (6)
+    0x81, 0x00, //   Input (Data, Array, Absolute)
+    0xc0,       // End Collection
+};
+
+typedef struct {
+    int evdev_fd;
+    int stop;
+    unsigned long wakeups;
+    unsigned long events;
+} reader_t;
+
+/**
+ * Read the evdev node the way the daemon's event loop does until stopped
+ */
+static void *read_events(void *arg)
+{
+    reader_t *reader = arg;
+    struct input_event events[EVDEV_READ_BATCH];
+    struct pollfd pfd = { .fd = reader->evdev_fd, .events = POLLIN };
+
+    while (!__atomic_load_n(&reader->stop, __ATOMIC_RELAXED))
+    {
+        if (poll(&pfd, 1, 100) <= 0)
+            continue;
+        ssize_t size = read(reader->evdev_fd, events, sizeof(events));
+        reader->wakeups++;
+        if (size > 0)
+            reader->events += size / sizeof(events[0]);
+    }
+    return nullptr;
+}
+
+/**
+ * Type KEYSTROKES presses and releases of A while a reader counts its wakeups
+ * @param masked: apply the daemon's evdev mask first
+ * @return 0 on success, -1 on error
+ */
+static int run(int uhid_fd, int masked)
+{
+    const struct timespec settle = { .tv_nsec = 200 * 1000 * 1000 };
+    const unsigned char press[8] = { [2] = BOOT_KEY_A }, release[8] = {};
+    reader_t reader = {};
+    pthread_t thread;
+    int hid_id, err = 0;
+
+    reader.evdev_fd = uhid_open_node("input/input*/event*", "/dev/input", O_RDONLY | O_NONBLOCK, &hid_id);
+    if (reader.evdev_fd < 0)
+        return -1;
+    if (masked && device_session_mask_evdev(reader.evdev_fd, fn_esc_keys,
+        sizeof(fn_esc_keys) / sizeof(fn_esc_keys[0]))) {
+        close(reader.evdev_fd);
+        return -1;
+    }
+    if (pthread_create(&thread, nullptr, read_events, &reader)) {
+        perror("Failed to start the reader");
+        close(reader.evdev_fd);
+        return -1;
+    }
+
+    for (int i = 0; !err && i < KEYSTROKES; i++)
+        err = uhid_input(uhid_fd, press, sizeof(press)) || uhid_input(uhid_fd, release, sizeof(release));
+    nanosleep(&settle, nullptr);
+    __atomic_store_n(&reader.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, nullptr);
+    close(reader.evdev_fd);
+
+    printf("%-9s %6lu wakeups, %6lu events for %d keystrokes\n", masked ? "masked" : "unmasked",
+        reader.wakeups, reader.events, KEYSTROKES);
+    return err ? -1 : 0;
+}
+
+int main()
+{
+    int uhid_fd, err;
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "The evdev benchmark needs root\n");
+        return 1;
+    }
+    uhid_fd = uhid_create("pxFnLock evdev test", report_descriptor, sizeof(report_descriptor));
+    if (uhid_fd < 0)
+        return 1;
+    err = run(uhid_fd, 0) || run(uhid_fd, 1);
+    uhid_destroy(uhid_fd);
+    return err;
+}
@@ -0,0 +1,180 @@
+// Round trip of the fn lock feature report on a uhid virtual keyboard: through the send_fn_lock syscall program
+// against a HIDIOCSFEATURE on hidraw, the path the daemon used before. A thread answers the SET_REPORTs like
+// the keyboard's firmware would, so both paths include the same device round trip.
+// Needs root, uhid and a kernel with HID-BPF struct_ops. It unpins everything under /sys/fs/bpf/pxfnlock,
+// so it refuses to run next to the daemon.
+// usage: sudo make bench-fn-lock
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/hidraw.h>
+#include <linux/uhid.h>
+#include "../bpf/loader.h"
+#include "uhid_device.h"
+
+#define SAMPLES 1000
+
+// the ProArt's vendor collection: the hotkey input report and the fn lock feature report, both id 0x5a
+static const unsigned char report_descriptor[] = {
+    0x06, 0x31, 0xff,       // Usage Page (Vendor 0xff31)
+    0x09, 0x76,             // Usage (0x76)
+    0xa1, 0x01,             // Collection (Application)
+    0x85, HOTKEY_REPORT_ID, //   Report ID
+    0x19, 0x00,             //   Usage Minimum (0)
+    0x2a, 0xff, 0x00,       //   Usage Maximum (255)
+    0x15, 0x00,             //   Logical Minimum (0)
+    0x26, 0xff, 0x00,       //   Logical Maximum (255)
+    0x75, 0x08,             //   Report Size (8)
+    0x95, HOTKEY_REPORT_SIZE - 1, // Report Count
+    0x81, 0x00,             //   Input (Data, Array, Absolute)
+    0x09, 0x77,             //   Usage (0x77)
+    0x95, FN_LOCK_REPORT_SIZE - 1, // Report Count
+    0xb1, 0x02,             //   Feature (Data, Variable, Absolute)
+    0xc0,                   // End Collection
+};
+
+typedef struct {
+    int uhid_fd;
+    int stop;
+    int answered;
+} responder_t;
+
+/**
+ * Acknowledge every SET_REPORT the HID core forwards to the device until stopped
+ */
+static void *respond(void *arg)
+{
+    responder_t *responder = arg;
+    struct pollfd pfd = { .fd = responder->uhid_fd, .events = POLLIN };
+    struct uhid_event ev;
+
+    while (!__atomic_load_n(&responder->stop, __ATOMIC_RELAXED))
+    {
+        if (poll(&pfd, 1, 100) <= 0 || read(responder->uhid_fd, &ev, sizeof(ev)) <= 0)
+            continue;
+        if (ev.type != UHID_SET_REPORT)
+            continue;
+        struct uhid_event reply = { .type = UHID_SET_REPORT_REPLY };
+        reply.u.set_report_reply.id = ev.u.set_report.id;
+        if (write(responder->uhid_fd, &reply, sizeof(reply)) != sizeof(reply))
+            perror("Failed to answer SET_REPORT");
+        responder->answered++;
+    }
+    return nullptr;
+}
+
+static double elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void print_samples(const char *path, double *samples)
+{
+    qsort(samples, SAMPLES, sizeof(samples[0]), compare_doubles);
+    printf("%-8s median %7.1f us, p99 %7.1f us\n", path, samples[SAMPLES / 2], samples[SAMPLES * 99 / 100]);
+}
+
+/**
+ * Time SAMPLES reports through the send_fn_lock program, alternating the state
+ * @return 0 on success, -1 on error
+ */
+static int time_bpf(int hid_id, double *samples)
+{
+    struct timespec start;
+
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (bpf_send_fn_lock(hid_id, i & 1))
+            return -1;
+        samples[i] = elapsed_us(&start);
+    }
+    return 0;
+}
+
+/**
+ * Time SAMPLES reports through hidraw, alternating the state
+ * @return 0 on success, -1 on error
+ */
+static int time_hidraw(int hidraw_fd, double *samples)
+{
+    unsigned char buf[FN_LOCK_REPORT_SIZE] = { FN_LOCK_REPORT_ID, FN_LOCK_REPORT_CMD, FN_LOCK_REPORT_SUB };
+    struct timespec start;
+
+    for (int i = 0; i < SAMPLES; i++)
+    {
+        buf[FN_LOCK_REPORT_STATE_OFFSET] = i & 1;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (ioctl(hidraw_fd, HIDIOCSFEATURE(sizeof(buf)), buf) < 0) {
+            perror("Failed to send the feature report through hidraw");
+            return -1;
+        }
+        samples[i] = elapsed_us(&start);
+    }
+    return 0;
+}
+
+int main()
+{
+    static double bpf_samples[SAMPLES], hidraw_samples[SAMPLES];
+    bpf_options_t options = {};
+    responder_t responder = {};
+    pthread_t thread;
+    int hid_id, hidraw_fd, err = 1;
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "The fn lock benchmark needs root\n");
+        return 1;
+    }
+    if (bpf_unpin_all()) {
+        fprintf(stderr, "Stop the daemon before running the fn lock benchmark\n");
+        return 1;
+    }
+
+    responder.uhid_fd = uhid_create("pxFnLock fn lock test", report_descriptor, sizeof(report_descriptor));
+    if (responder.uhid_fd < 0)
+        return 1;
+    if (pthread_create(&thread, nullptr, respond, &responder)) {
+        perror("Failed to start the responder");
+        uhid_destroy(responder.uhid_fd);
+        return 1;
+    }
+    hidraw_fd = uhid_open_node("hidraw/hidraw*", "/dev", O_RDWR, &hid_id);
+    if (hidraw_fd < 0)
+        goto out;
+    if (run_bpf(&options) || bpf_attach_device(hid_id, 0)) {
+        fprintf(stderr, "Failed to attach the program\n");
+        goto out;
+    }
+
+    if (time_hidraw(hidraw_fd, hidraw_samples) || time_bpf(hid_id, bpf_samples))
+        goto out;
+    printf("%d fn lock reports per path, %d SET_REPORTs answered\n", SAMPLES, responder.answered);
+    print_samples("hidraw", hidraw_samples);
+    print_samples("bpf", bpf_samples);
+    err = 0;
+
+out:
+    cleanup_bpf();
+    bpf_unpin_all();
+    if (hidraw_fd >= 0)
+        close(hidraw_fd);
+    __atomic_store_n(&responder.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, nullptr);
+    uhid_destroy(responder.uhid_fd);
+    return err;
+}
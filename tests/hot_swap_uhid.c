@@ -0,0 +1,168 @@
+// Hot swap test on a uhid virtual keyboard: one version of the program is attached and left pinned like a
+// daemon that exited, then a second version swaps onto its link while a thread keeps injecting hotkey reports.
+// The remaps are chained, so every report has to come out of hidraw remapped exactly once: untouched means
+// neither version acted on it, the end of the chain means both did.
+// Needs root, uhid and a kernel with HID-BPF struct_ops. It unpins everything under /sys/fs/bpf/pxfnlock,
+// so it refuses to run next to the daemon.
+// usage: sudo make test-hotswap
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../bpf/loader.h"
+#include "uhid_device.h"
+
+#define TEST_FROM 0x4e
+#define TEST_TO 0x5c
+#define TEST_CHAINED 0x38 // TEST_TO's own remap, only reached when a report is remapped twice
+#define TEST_REPORT_SIZE HOTKEY_REPORT_SIZE
+#define TEST_RUN_MS 200
+
+// a vendor input report with HOTKEY_REPORT_ID and five bytes of payload, like the ProArt's hotkey report
+static const unsigned char report_descriptor[] = {
+    0x06, 0x31, 0xff,       // Usage Page (Vendor 0xff31)
+    0x09, 0x76,             // Usage (0x76)
+    0xa1, 0x01,             // Collection (Application)
+    0x85, HOTKEY_REPORT_ID, //   Report ID
+    0x19, 0x00,             //   Usage Minimum (0)
+    0x2a, 0xff, 0x00,       //   Usage Maximum (255)
+    0x15, 0x00,             //   Logical Minimum (0)
+    0x26, 0xff, 0x00,       //   Logical Maximum (255)
+    0x75, 0x08,             //   Report Size (8)
+    0x95, TEST_REPORT_SIZE - 1, // Report Count
+    0x81, 0x00,             //   Input (Data, Array, Absolute)
+    0xc0,                   // End Collection
+};
+
+typedef struct {
+    int uhid_fd;
+    int hidraw_fd;
+    int stop;
+    int sent;
+    int untouched; // came back with the original scancode or not at all
+    int doubled;   // remapped by both versions
+} injector_t;
+
+static int check(int ok, const char *what)
+{
+    fprintf(stderr, "%s: %s\n", ok ? "ok  " : "FAIL", what);
+    return ok ? 0 : 1;
+}
+
+static void sleep_ms(int ms)
+{
+    const struct timespec delay = { .tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L };
+    nanosleep(&delay, nullptr);
+}
+
+/**
+ * Inject hotkey presses one at a time and read each back from hidraw
+ */
+static void *inject(void *arg)
+{
+    injector_t *injector = arg;
+    const unsigned char press[TEST_REPORT_SIZE] = { HOTKEY_REPORT_ID, TEST_FROM };
+    unsigned char buf[64];
+    struct pollfd pfd = { .fd = injector->hidraw_fd, .events = POLLIN };
+
+    while (!__atomic_load_n(&injector->stop, __ATOMIC_RELAXED))
+    {
+        if (uhid_input(injector->uhid_fd, press, sizeof(press)))
+            break;
+        injector->sent++;
+        if (poll(&pfd, 1, 1000) <= 0) {
+            injector->untouched++;
+            break;
+        }
+        ssize_t size = read(injector->hidraw_fd, buf, sizeof(buf));
+        if (size == TEST_REPORT_SIZE && buf[0] == HOTKEY_REPORT_ID && buf[1] == TEST_CHAINED)
+            injector->doubled++;
+        else if (size != TEST_REPORT_SIZE || buf[0] != HOTKEY_REPORT_ID || buf[1] != TEST_TO)
+            injector->untouched++;
+    }
+    return nullptr;
+}
+
+int main()
+{
+    const int remaps[] = { TEST_FROM, TEST_TO, TEST_TO, TEST_CHAINED };
+    bpf_options_t options = {
+        .remap_array = remaps,
+        .remap_count = 2,
+    };
+    injector_t injector = {};
+    char before[64] = "", after[64] = "", path[MAX_PATH];
+    pthread_t thread;
+    int hid_id, failed = 0;
+
+    if (geteuid() != 0) {
+        fprintf(stderr, "The hot swap test needs root\n");
+        return 1;
+    }
+    if (bpf_unpin_all()) {
+        fprintf(stderr, "Stop the daemon before running the hot swap test\n");
+        return 1;
+    }
+
+    injector.uhid_fd = uhid_create("pxFnLock hot swap test", report_descriptor, sizeof(report_descriptor));
+    if (injector.uhid_fd < 0)
+        return 1;
+    injector.hidraw_fd = uhid_open_node("hidraw/hidraw*", "/dev", O_RDONLY, &hid_id);
+    if (injector.hidraw_fd < 0) {
+        uhid_destroy(injector.uhid_fd);
+        return 1;
+    }
+
+    // the old version: attached and pinned, then its process goes away
+    if (run_bpf(&options) || bpf_attach_device(hid_id, 0)) {
+        fprintf(stderr, "Failed to attach the first version\n");
+        close(injector.hidraw_fd);
+        uhid_destroy(injector.uhid_fd);
+        return 1;
+    }
+    cleanup_bpf();
+    failed |= check(readlink(BPF_CURRENT_PIN, before, sizeof(before) - 1) > 0, "first version pinned");
+
+    if (pthread_create(&thread, nullptr, inject, &injector)) {
+        perror("Failed to start the injector");
+        close(injector.hidraw_fd);
+        uhid_destroy(injector.uhid_fd);
+        return 1;
+    }
+    sleep_ms(TEST_RUN_MS / 2);
+
+    // the same remap baked into .rodata makes a different version, which swaps onto the pinned link
+    options.static_remaps = 1;
+    failed |= check(run_bpf(&options) == 0, "second version loaded");
+    // the hand over is reported on the ring buffer, the daemon's event loop drops the old link there
+    struct pollfd pfd = { .fd = bpf_events_fd(), .events = POLLIN };
+    for (int waited = 0; pfd.fd >= 0 && waited < TEST_RUN_MS / 2; waited += 10)
+    {
+        if (poll(&pfd, 1, 10) > 0)
+            bpf_consume_events();
+    }
+    __atomic_store_n(&injector.stop, 1, __ATOMIC_RELAXED);
+    pthread_join(thread, nullptr);
+
+    failed |= check(readlink(BPF_CURRENT_PIN, after, sizeof(after) - 1) > 0 && strcmp(before, after) != 0,
+        "second version pinned as current");
+    snprintf(path, sizeof(path), "%s/link_%d", BPF_CURRENT_PIN, hid_id);
+    failed |= check(access(path, F_OK) == 0, "keyboard link swapped to the second version");
+    snprintf(path, sizeof(path), "%s/%s", BPF_PIN_DIR, before);
+    failed |= check(access(path, F_OK) != 0 && errno == ENOENT, "first version unpinned");
+    fprintf(stderr, "%d reports injected, %d untouched, %d remapped twice\n",
+        injector.sent, injector.untouched, injector.doubled);
+    failed |= check(injector.sent > 0 && injector.untouched == 0 && injector.doubled == 0,
+        "every report remapped exactly once through the swap");
+
+    cleanup_bpf();
+    bpf_unpin_all();
+    close(injector.hidraw_fd);
+    uhid_destroy(injector.uhid_fd);
+    return failed;
+}
@@ -0,0 +1,68 @@
+// The daemon's program plus a SEC("syscall") entry point that times lookup_remap with BPF_PROG_TEST_RUN,
+// hid_bpf_ops programs have no test_run of their own. Including the source keeps the lookup the same code.
+#include "../bpf/hid_modify.bpf.c"
+#include "remap_bench.h"
+
+// the layout before the direct indexed table: scancode keyed, filled with the same pairs
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __type(key, u32);
+    __type(value, u32);
+    __uint(max_entries, 32);
+} bench_remap_hash SEC(".maps");
+
+// bpf_loop's context has to live on the stack, the program's ctx can't be passed to the callbacks
+struct bench_loop {
+    __u64 hits;
+};
+
+static long bench_empty_step(u32 i, void *ctx)
+{
+    struct bench_loop *loop = ctx;
+
+    loop->hits += i & 1;
+    return 0;
+}
+
+static long bench_hash_step(u32 i, void *ctx)
+{
+    struct bench_loop *loop = ctx;
+    u32 code = i & 0xff;
+
+    if (bpf_map_lookup_elem(&bench_remap_hash, &code))
+        loop->hits++;
+    return 0;
+}
+
+static long bench_table_step(u32 i, void *ctx)
+{
+    struct bench_loop *loop = ctx;
+    __u8 to;
+
+    if (lookup_remap(i & 0xff, &to))
+        loop->hits++;
+    return 0;
+}
+
+/**
+ * Look every scancode up in turn, req->iterations times, and time the loop
+ * @param req: mode and iteration count in, time and hits out
+ * @return 0
+ */
+SEC("syscall")
+int bench_remap(struct remap_bench_request *req)
+{
+    struct bench_loop loop = {};
+    __u32 iterations = req->iterations;
+    __u64 start = bpf_ktime_get_ns();
+
+    if (req->mode == BENCH_HASH)
+        bpf_loop(iterations, bench_hash_step, &loop, 0);
+    else if (req->mode == BENCH_TABLE)
+        bpf_loop(iterations, bench_table_step, &loop, 0);
+    else
+        bpf_loop(iterations, bench_empty_step, &loop, 0);
+    req->ns = bpf_ktime_get_ns() - start;
+    req->hits = loop.hits;
+    return 0;
+}
@@ -0,0 +1,212 @@
+// Per lookup cost of the remap table against the scancode keyed hash it replaced and against --static-remaps,
+// timed inside the kernel by the bench_remap syscall program, and the cost of replacing the whole table.
+// No keyboard needed, only root and a kernel that can load the daemon's program.
+// usage: sudo make bench-remap
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include "../bpf/common.h"
+#include "../device_profile.h"
+#include "remap_bench.h"
+#include "remap_bench.skel.h"
+
+#define BENCH_ITERATIONS (8 * 1000 * 1000) // bpf_loop's limit is 1 << 23
+#define BENCH_RUNS 5
+#define UPDATE_RUNS 1000
+
+static const char *mode_names[] = {
+    [BENCH_EMPTY] = "empty loop",
+    [BENCH_HASH] = "hash",
+    [BENCH_TABLE] = "table",
+};
+
+/**
+ * Run one mode BENCH_RUNS times
+ * @param prog_fd: the bench_remap program
+ * @param mode: enum remap_bench_mode
+ * @return the fastest run in ns per iteration, -1 on error
+ */
+static double run_mode(int prog_fd, __u32 mode)
+{
+    double best = -1;
+
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        struct remap_bench_request req = { .mode = mode, .iterations = BENCH_ITERATIONS };
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+            .ctx_in = &req,
+            .ctx_size_in = sizeof(req),
+            .ctx_out = &req,
+            .ctx_size_out = sizeof(req),
+        );
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts)) {
+            perror("Failed to run bench_remap");
+            return -1;
+        }
+        double per_iteration = (double)req.ns / BENCH_ITERATIONS;
+        if (best < 0 || per_iteration < best)
+            best = per_iteration;
+    }
+    return best;
+}
+
+/**
+ * Fill the table and the hash with the built in profile's remaps
+ * @return 0 on success, -1 on error
+ */
+static int fill_remaps(struct remap_bench *skel)
+{
+    const device_profile_t *profile = get_device_profile(0);
+
+    for (int i = 0; i < profile->remap_count; i++)
+    {
+        __u32 from = profile->remaps[i * 2], to = profile->remaps[i * 2 + 1];
+        __u16 entry = REMAP_PRESENT | to;
+        if (bpf_map_update_elem(bpf_map__fd(skel->maps.remap_table), &from, &entry, BPF_ANY) ||
+            bpf_map_update_elem(bpf_map__fd(skel->maps.bench_remap_hash), &from, &to, BPF_ANY))
+            return -1;
+    }
+    return 0;
+}
+
+/**
+ * Open and load the bench object, nothing of it is attached to a keyboard
+ * @param static_remaps: bake the profile's remaps into .rodata like --static-remaps does
+ * @return the skeleton, nullptr on error
+ */
+static struct remap_bench *load_bench(int static_remaps)
+{
+    const device_profile_t *profile = get_device_profile(0);
+    struct remap_bench *skel = remap_bench__open();
+
+    if (!skel) {
+        fprintf(stderr, "Failed to open the bench skeleton\n");
+        return nullptr;
+    }
+    bpf_map__set_autocreate(skel->maps.hid_modify_ops, false);
+    bpf_program__set_autoload(skel->progs.modify_hid_event, false);
+    bpf_program__set_autoload(skel->progs.send_fn_lock, false);
+    for (int i = 0; static_remaps && i < profile->remap_count; i++)
+    {
+        skel->rodata->static_remap_from[i] = profile->remaps[i * 2];
+        skel->rodata->static_remap_to[i] = profile->remaps[i * 2 + 1];
+        skel->rodata->static_remap_count++;
+    }
+    if (remap_bench__load(skel) || fill_remaps(skel)) {
+        fprintf(stderr, "Failed to load the bench program\n");
+        remap_bench__destroy(skel);
+        return nullptr;
+    }
+    return skel;
+}
+
+static double elapsed_us(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+/**
+ * Replace the whole table the way bpf_update_remaps does: a new inner table filled with one batch update,
+ * then published with a single update of remap_map's slot
+ * @return the mean time per replacement in us, -1 on error
+ */
+static double time_table_swap(struct remap_bench *skel)
+{
+    const device_profile_t *profile = get_device_profile(0);
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 keys[REMAP_SLOTS];
+    __u16 values[REMAP_SLOTS] = {};
+    const __u32 key = 0;
+    struct timespec start;
+
+    for (__u32 i = 0; i < REMAP_SLOTS; i++)
+        keys[i] = i;
+    for (int i = 0; i < profile->remap_count; i++)
+        values[profile->remaps[i * 2]] = REMAP_PRESENT | profile->remaps[i * 2 + 1];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int run = 0; run < UPDATE_RUNS; run++)
+    {
+        __u32 count = REMAP_SLOTS;
+        int table_fd = bpf_map_create(BPF_MAP_TYPE_ARRAY, "remap_table", sizeof(__u32), sizeof(__u16), REMAP_SLOTS, nullptr);
+        int err = table_fd < 0 || bpf_map_update_batch(table_fd, keys, values, &count, &opts) ||
+            bpf_map_update_elem(bpf_map__fd(skel->maps.remap_map), &key, &table_fd, BPF_ANY);
+        if (table_fd >= 0)
+            close(table_fd);
+        if (err) {
+            perror("Failed to swap the remap table");
+            return -1;
+        }
+    }
+    return elapsed_us(&start) / UPDATE_RUNS;
+}
+
+/**
+ * Replace the remaps one element at a time in the hash, the way they were updated before the table
+ * @return the mean time per replacement in us, -1 on error
+ */
+static double time_hash_updates(struct remap_bench *skel)
+{
+    const device_profile_t *profile = get_device_profile(0);
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int run = 0; run < UPDATE_RUNS; run++)
+    {
+        for (int i = 0; i < profile->remap_count; i++)
+        {
+            __u32 from = profile->remaps[i * 2], to = profile->remaps[i * 2 + 1];
+            if (bpf_map_update_elem(bpf_map__fd(skel->maps.bench_remap_hash), &from, &to, BPF_ANY)) {
+                perror("Failed to update the remap hash");
+                return -1;
+            }
+        }
+    }
+    return elapsed_us(&start) / UPDATE_RUNS;
+}
+
+int main()
+{
+    struct remap_bench *skel = load_bench(0), *static_skel = nullptr;
+    double ns[sizeof(mode_names) / sizeof(mode_names[0])], static_ns, swap_us, hash_us;
+    int err = 1;
+
+    if (!skel)
+        return 1;
+    static_skel = load_bench(1);
+    if (!static_skel)
+        goto out;
+
+    for (__u32 mode = 0; mode < sizeof(ns) / sizeof(ns[0]); mode++)
+    {
+        ns[mode] = run_mode(bpf_program__fd(skel->progs.bench_remap), mode);
+        if (ns[mode] < 0)
+            goto out;
+    }
+    // the static object's lookup_remap never reaches the map, the verifier dropped that path
+    static_ns = run_mode(bpf_program__fd(static_skel->progs.bench_remap), BENCH_TABLE);
+    swap_us = time_table_swap(skel);
+    hash_us = time_hash_updates(skel);
+    if (static_ns < 0 || swap_us < 0 || hash_us < 0)
+        goto out;
+
+    printf("%d lookups per run, best of %d, loop overhead %.2f ns\n", BENCH_ITERATIONS, BENCH_RUNS, ns[BENCH_EMPTY]);
+    for (__u32 mode = BENCH_HASH; mode < sizeof(ns) / sizeof(ns[0]); mode++)
+        printf("%-12s %6.2f ns/lookup\n", mode_names[mode], ns[mode] - ns[BENCH_EMPTY]);
+    printf("%-12s %6.2f ns/lookup\n", "static", static_ns - ns[BENCH_EMPTY]);
+    printf("%d remaps replaced, mean of %d: table swap %.1f us, per element hash updates %.1f us\n",
+        get_device_profile(0)->remap_count, UPDATE_RUNS, swap_us, hash_us);
+    err = 0;
+
+out:
+    remap_bench__destroy(static_skel);
+    remap_bench__destroy(skel);
+    return err;
+}
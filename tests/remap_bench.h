@@ -0,0 +1,23 @@
+#ifndef HIDTEST3_REMAP_BENCH_H
+#define HIDTEST3_REMAP_BENCH_H
+
+#ifndef __VMLINUX_H__
+#include <linux/types.h>
+#endif
+
+// what the bench_remap program times per iteration
+enum remap_bench_mode {
+    BENCH_EMPTY, // the loop alone, subtracted from the others
+    BENCH_HASH,  // the scancode keyed hash the remap map was before the direct indexed table
+    BENCH_TABLE, // lookup_remap as the daemon runs it
+};
+
+// context of the bench_remap syscall program
+struct remap_bench_request {
+    __u32 mode;       // enum remap_bench_mode
+    __u32 iterations;
+    __u64 ns;         // set by the program, time spent in the loop
+    __u64 hits;       // set by the program, lookups that found a remap, keeps them from being optimized out
+};
+
+#endif //HIDTEST3_REMAP_BENCH_H
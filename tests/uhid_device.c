@@ -0,0 +1,114 @@
+// Virtual HID devices for the tests and benchmarks that need the kernel's HID path, needs root and uhid
+#include "uhid_device.h"
+#include <fcntl.h>
+#include <glob.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/uhid.h>
+
+/**
+ * Create a device with the test ids and wait until the HID core started it
+ * @param name: the device's name
+ * @param descriptor: its report descriptor
+ * @param size: size of descriptor
+ * @return the uhid fd, -1 on error
+ */
+int uhid_create(const char *name, const unsigned char *descriptor, size_t size)
+{
+    struct uhid_event ev = { .type = UHID_CREATE2 };
+    struct pollfd pfd;
+    int fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+
+    if (fd < 0) {
+        perror("Failed to open /dev/uhid");
+        return -1;
+    }
+    snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s", name);
+    ev.u.create2.rd_size = size;
+    ev.u.create2.bus = BUS_USB;
+    ev.u.create2.vendor = UHID_TEST_VID;
+    ev.u.create2.product = UHID_TEST_PID;
+    memcpy(ev.u.create2.rd_data, descriptor, size);
+    if (write(fd, &ev, sizeof(ev)) != sizeof(ev)) {
+        perror("Failed to create the uhid device");
+        close(fd);
+        return -1;
+    }
+
+    pfd = (struct pollfd){ .fd = fd, .events = POLLIN };
+    while (poll(&pfd, 1, 1000) > 0)
+    {
+        if (read(fd, &ev, sizeof(ev)) > 0 && ev.type == UHID_START)
+            return fd;
+    }
+    fprintf(stderr, "The uhid device never started\n");
+    close(fd);
+    return -1;
+}
+
+/**
+ * Open a node of the newest device with the test ids, udev creates it shortly after the device appears
+ * @param node_glob: the node's sysfs path below the HID device, e.g. "hidraw/hidraw*"
+ * @param dev_dir: where the node lives, e.g. "/dev"
+ * @param flags: open flags
+ * @param hid_id: set to the device's HID id
+ * @return the fd, -1 on error
+ */
+int uhid_open_node(const char *node_glob, const char *dev_dir, int flags, int *hid_id)
+{
+    const struct timespec retry = { .tv_nsec = 10 * 1000 * 1000 };
+    char pattern[256], node[128];
+    glob_t matches;
+    int fd = -1;
+
+    snprintf(pattern, sizeof(pattern), "/sys/bus/hid/devices/0003:%04X:%04X.*/%s",
+        UHID_TEST_VID, UHID_TEST_PID, node_glob);
+    for (int tries = 0; fd < 0 && tries < 100; tries++, nanosleep(&retry, nullptr))
+    {
+        if (glob(pattern, 0, nullptr, &matches) != 0)
+            continue;
+        // ids have the same width, the last match is the newest device
+        const char *path = matches.gl_pathv[matches.gl_pathc - 1];
+        if (sscanf(path, "/sys/bus/hid/devices/%*x:%*x:%*x.%x", hid_id) == 1)
+        {
+            snprintf(node, sizeof(node), "%s/%s", dev_dir, strrchr(path, '/') + 1);
+            fd = open(node, flags | O_CLOEXEC);
+        }
+        globfree(&matches);
+    }
+    if (fd < 0)
+        fprintf(stderr, "Failed to open the test device's %s node\n", node_glob);
+    return fd;
+}
+
+/**
+ * Send an input report as if the device did, the HID core handles it before the write returns
+ * @return 0 on success, -1 on error
+ */
+int uhid_input(int uhid_fd, const unsigned char *report, size_t size)
+{
+    struct uhid_event ev = { .type = UHID_INPUT2 };
+
+    ev.u.input2.size = size;
+    memcpy(ev.u.input2.data, report, size);
+    if (write(uhid_fd, &ev, sizeof(ev)) != sizeof(ev)) {
+        perror("Failed to inject a report");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Remove the device and close its uhid fd
+ */
+void uhid_destroy(int uhid_fd)
+{
+    struct uhid_event ev = { .type = UHID_DESTROY };
+
+    if (write(uhid_fd, &ev, sizeof(ev)) != sizeof(ev))
+        perror("Failed to destroy the uhid device");
+    close(uhid_fd);
+}
@@ -0,0 +1,15 @@
+#ifndef HIDTEST3_UHID_DEVICE_H
+#define HIDTEST3_UHID_DEVICE_H
+
+#include <stddef.h>
+
+// pid.codes test ids, hid-generic binds the device and no real keyboard matches them
+#define UHID_TEST_VID 0x1209
+#define UHID_TEST_PID 0x0001
+
+int uhid_create(const char *name, const unsigned char *descriptor, size_t size);
+int uhid_open_node(const char *node_glob, const char *dev_dir, int flags, int *hid_id);
+int uhid_input(int uhid_fd, const unsigned char *report, size_t size);
+void uhid_destroy(int uhid_fd);
+
+#endif //HIDTEST3_UHID_DEVICE_H
@@ -0,0 +1,66 @@
+#include "uevent.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+/**
+ * Open a netlink socket receiving kernel uevents
+ * @return the socket fd on success, -1 on failure
+ */
+int open_uevent_socket()
+{
+    struct sockaddr_nl addr = {
+        .nl_family = AF_NETLINK,
+        .nl_pid = 0,
+        .nl_groups = 1, // kernel uevents, as opposed to the ones re-broadcast by udev
+    };
+
+    int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_KOBJECT_UEVENT);
+    if (fd < 0)
+    {
+        perror("Failed to open uevent socket");
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        perror("Failed to bind uevent socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Read one uevent message and pick out the fields we care about.
+ * The message is "action@devpath" followed by NUL separated KEY=VALUE pairs.
+ * @param fd: socket from open_uevent_socket
+ * @param buffer: storage for the message, the fields in event point into it
+ * @param buffer_size: size of buffer
+ * @param event: filled with the parsed fields, missing fields are empty strings
+ * @return 0 on success, -1 if nothing could be read
+ */
+int read_uevent(int fd, char *buffer, int buffer_size, uevent_t *event)
+{
+    ssize_t len = recv(fd, buffer, buffer_size - 1, 0);
+    if (len <= 0)
+        return -1;
+    buffer[len] = '\0';
+
+    event->action = "";
+    event->devpath = "";
+    event->subsystem = "";
+
+    for (char *field = buffer; field < buffer + len; field += strlen(field) + 1)
+    {
+        if (strncmp(field, "ACTION=", 7) == 0)
+            event->action = field + 7;
+        else if (strncmp(field, "DEVPATH=", 8) == 0)
+            event->devpath = field + 8;
+        else if (strncmp(field, "SUBSYSTEM=", 10) == 0)
+            event->subsystem = field + 10;
+    }
+    return 0;
+}
@@ -0,0 +1,15 @@
+#ifndef HIDTEST3_UEVENT_H
+#define HIDTEST3_UEVENT_H
+
+#define UEVENT_BUFFER_SIZE 4096
+
+typedef struct {
+    const char *action;    // e.g. "add", "remove", "bind"
+    const char *devpath;   // sysfs path without the /sys prefix
+    const char *subsystem; // e.g. "hid", "hidraw", "input"
+} uevent_t;
+
+int open_uevent_socket();
+int read_uevent(int fd, char *buffer, int buffer_size, uevent_t *event);
+
+#endif //HIDTEST3_UEVENT_H